@@ -80,6 +80,18 @@ typedef enum {
 
 typedef int (*audio_start_cb)(void *priv, avs_ascb_reason reason);
 
+typedef enum {
+    /* toggled with a newer frame in the same VSYNC, not displayed */
+    AV_SYNC_FREE_DROPPED,
+    /* left in queue by av_sync_destroy */
+    AV_SYNC_FREE_FLUSH,
+    /* same pts as the previous pushed frame */
+    AV_SYNC_FREE_DUPLICATE,
+} avs_free_reason;
+
+typedef void (*free_frames_cb)(struct vframe **frames, int n,
+        avs_free_reason reason, void *priv);
+
 typedef enum {
     AV_SYNC_ASTART_SYNC = 0,
     AV_SYNC_ASTART_ASYNC,
@@ -117,6 +129,7 @@ struct vframe {
     pts90K duration;
     /* free function, will be called when multi frames are
      * toggled in a single VSYNC, on frames not for display.
+     * Not used when av_sync_set_free_frames_cb is set.
      * For the last toggled frame, free won't be called. Caller
      * of av_sync_pop_frame() are responsible for free poped frame.
      * For example, if frame 1/2/3 are toggled in a single VSYCN,
@@ -145,10 +158,72 @@ struct start_policy {
     /*timeout in ms */
     int timeout;
 };
+enum clock_recovery_algo {
+    /* AML_AVSYNC_CLK_RECOVERY env ("group", "lsq" or "kalman"),
+     * else group
+     */
+    CLK_RECOVERY_ALGO_DEFAULT = 0,
+    /* 1000 sample groups, minutes to converge */
+    CLK_RECOVERY_ALGO_GROUP,
+    /* streaming least squares, constant memory, ready in seconds
+     * on a clean stream
+     */
+    CLK_RECOVERY_ALGO_LSQ,
+    /* Kalman filter, first ppm within seconds on a clean stream, then
+     * refined. See av_sync_get_clock_confidence.
+     */
+    CLK_RECOVERY_ALGO_KALMAN,
+};
+
+struct av_sync_config {
+    /* video frame queue depth, 0 for default (32).
+     * Must not be smaller than start_thres.
+     */
+    int frame_queue_depth;
+    /* PCR clock recovery of AV_SYNC_TYPE_PCR handles */
+    enum clock_recovery_algo clk_recovery;
+};
+
 struct underflow_config {
     int time_thresh; /* underflow check time threshold in ms */
 };
 
+struct apts_publish_policy {
+    /* publish at most once per interval of rendered audio, in ms.
+     * 0 publishes on every render.
+     */
+    int min_interval;
+    /* publish right away when render delta moves more than this, in ms */
+    int max_drift;
+};
+
+struct av_sync_stats {
+    /* AV_SYNC_AA_RENDER decisions of av_sync_audio_render */
+    uint64_t apts_render_cnt;
+    /* audio timestamps actually sent to msync */
+    uint64_t apts_publish_cnt;
+    /* video frame queue depth and most frames ever queued */
+    uint32_t frame_q_depth;
+    uint32_t frame_q_high_watermark;
+    /* pause pts and underflow callbacks: count, time spent in them,
+     * and events lost because the client did not keep up
+     */
+    uint64_t cb_cnt;
+    uint64_t cb_total_ns;
+    uint64_t cb_max_ns;
+    uint64_t cb_lost;
+    /* session state lookups of pause and audio switch APIs, and how many
+     * of them went to msync instead of the notification fed mirror
+     */
+    uint64_t state_query_cnt;
+    uint64_t state_ioctl_cnt;
+    /* time to ready of av_sync_create(), and the part of it spent
+     * waiting for the session device node, in us
+     */
+    uint32_t create_us;
+    uint32_t dev_wait_us;
+};
+
 /* Open a new session and create the ID
  * Params:
  *   @session_id: session ID allocated if success
@@ -190,6 +265,57 @@ void* av_sync_create(int session_id,
                      enum sync_type type,
                      int start_thres);
 
+/* Same as av_sync_create with extra creation options
+ * Params:
+ *   @config: options of struct av_sync_config, NULL for default.
+ * Return:
+ *   null for failure, or handle for avsync module.
+ */
+void* av_sync_create_ex(int session_id,
+                     enum sync_mode mode,
+                     enum sync_type type,
+                     int start_thres,
+                     const struct av_sync_config *config);
+
+/* Create a pool of handles kept ready for channel change.
+ * Everything not bound to a kernel session (frame queue, pattern detector,
+ * PCR monitor, event dispatch) is allocated up front and reused.
+ * Params:
+ *   @type: AV sync type of handles in the pool
+ *   @size: number of handles kept ready, up to 8
+ *   @config: options of struct av_sync_config, NULL for default.
+ * Return:
+ *   null for failure, or pool handle.
+ */
+void* av_sync_pool_create(enum sync_type type, int size,
+        const struct av_sync_config *config);
+
+/* Free the pool and the handles it holds.
+ * Handles taken out of it stay valid, destroy them with av_sync_destroy().
+ * Params:
+ *   @pool: pool handle
+ */
+void av_sync_pool_destroy(void *pool);
+
+/* Same as av_sync_create with a handle taken from @pool.
+ * A new handle is allocated when the pool is empty.
+ * Params:
+ *   @pool: pool handle
+ *   @session_id, @mode, @start_thres: see av_sync_create
+ * Return:
+ *   null for failure, or handle for avsync module.
+ */
+void* av_sync_pool_get(void *pool, int session_id,
+        enum sync_mode mode, int start_thres);
+
+/* Detach @sync from its session like av_sync_destroy, and give it back
+ * to @pool after a reset. Queued frames are released.
+ * Params:
+ *   @pool: pool handle
+ *   @sync: handle from av_sync_pool_get
+ */
+void av_sync_pool_put(void *pool, void *sync);
+
 
 /* Attach to an existed session. The returned avsync module will
  * associated with @session_id. use av_sync_destroy to destroy it.
@@ -243,6 +369,30 @@ int av_sync_pause(void *sync, bool pause);
  */
 int av_sync_push_frame(void *sync , struct vframe *frame);
 
+/* Push several video frames at once, e.g. after decoder flush.
+ * Frames become visible to av_sync_pop_frame together.
+ * Params:
+ *   @sync: AV sync module handle
+ *   @frames: frames in display order
+ *   @n: number of frames, up to the frame queue depth
+ * Return:
+ *   0 for OK, or error code. On error no frame is queued.
+ */
+int av_sync_push_frames(void *sync, struct vframe **frames, int n);
+
+/* Set batched frame release callback.
+ * Replaces vframe.free for frames not for display. All frames released
+ * by one av_sync_pop_frame/av_sync_push_frames/av_sync_destroy call are
+ * passed in a single callback, after the session lock is released.
+ * Params:
+ *   @sync: AV sync module handle
+ *   @cb: callback function, NULL to go back to vframe.free
+ *   @priv: callback function parameter
+ * Return:
+ *   0 for OK, or error code
+ */
+int av_sync_set_free_frames_cb(void *sync, free_frames_cb cb, void *priv);
+
 /* notify current system mono time for current VSYNC.
  * This API should be VSYNC triggerd. Used only in VIDEO_MONO mode.
  * Params:
@@ -332,6 +482,20 @@ int av_sync_change_mode(void *sync, enum sync_mode mode);
  */
 int av_sync_change_mode_by_id(int id, enum sync_mode mode);
 
+/* By-id getters, same as av_sync_get_mode/av_sync_get_clock/av_sync_get_pos.
+ * A handle of session @id in this process is used when there is one,
+ * otherwise the session device is opened for the call.
+ * Params:
+ *   @id: session ID
+ *   @type: AV_SYNC_TYPE_AUDIO or AV_SYNC_TYPE_VIDEO position
+ * Return:
+ *   0 for OK, or error code
+ */
+int av_sync_get_mode_by_id(int id, enum sync_mode *mode);
+int av_sync_get_clock_by_id(int id, pts90K *pts);
+int av_sync_get_pos_by_id(int id, enum sync_type type,
+        pts90K *pts, uint64_t *mono_clock);
+
 /* get avsync mode
  * Params:
  *   @sync: AV sync module handle
@@ -359,7 +523,8 @@ int av_sync_set_pause_pts(void *sync, pts90K pts);
 
 /* set pause PTS call back
  * av sync will callback when pause PTS is reached with assigned PTS from
- * @av_sync_set_pause_pts.
+ * @av_sync_set_pause_pts. Called from session event thread, see
+ * av_sync_get_event_fd.
  * Params:
  *   @sync: AV sync module handle
  *   @cb: callback function
@@ -412,6 +577,19 @@ int av_sync_get_clock(void *sync, pts90K *pts);
  */
 int av_sync_get_pos(void *sync, pts90K *pts, uint64_t *mono_clock);
 
+/* set how often audio render re-reads wall clock from msync.
+ * In between, av_sync_audio_render extrapolates the last wall clock
+ * with CLOCK_MONOTONIC_RAW, rate and clock deviation. Mode change
+ * events, pause and discontinuity always re-read it.
+ * Use by AV_SYNC_TYPE_AUDIO only. Default is 50ms.
+ * Params:
+ *   @sync: AV sync module handle
+ *   @interval_ms: re-read interval. 0 reads msync on every render.
+ * Return:
+ *   0 for OK, or error code
+ */
+int av_sync_set_audio_clock_interval(void *sync, int interval_ms);
+
 /* set session name for debugging purpose
  * The session name will be listed from /sys/class/aml_msync/list_session
  * Params:
@@ -460,8 +638,34 @@ int av_sync_get_audio_switch(void *sync,  bool *status);
  */
 enum  clock_recovery_stat av_sync_get_clock_deviation(void *sync, int32_t *ppm);
 
+/* Identify the broadcast source of PCR clock, e.g.
+ * original_network_id << 32 | transport_stream_id << 16 | service_id.
+ * The deviation converged for a source is kept across reboots, the next
+ * av_sync_set_pcr_clock of the same source applies it right away and
+ * clock recovery refines it from there. Cache file is
+ * AML_AVSYNC_PPM_CACHE env, else /data/avsync_ppm_cache.
+ * Set it before the first av_sync_set_pcr_clock of the channel.
+ * Params:
+ *   @sync: AV sync module handle of AV_SYNC_TYPE_PCR
+ *   @key: source identifier, 0 for none
+ * Return:
+ *   0 for OK, or error code
+ */
+int av_sync_set_clock_key(void *sync, uint64_t key);
+
+/* Get the 95% confidence interval of the PCR clock deviation estimation.
+ * Only CLK_RECOVERY_ALGO_LSQ and CLK_RECOVERY_ALGO_KALMAN have it.
+ * Params:
+ *   @sync: AV sync module handle of AV_SYNC_TYPE_PCR
+ *   @ci_ppm: half width in ppm, deviation is within +/- @ci_ppm
+ * Return:
+ *   0 for OK, or error code if not available yet
+ */
+int av_sync_get_clock_confidence(void *sync, int32_t *ci_ppm);
+
 /* set underflow detect call back
  * av sync will callback when a buffer underflow detected when normal play
+ * Called from session event thread, see av_sync_get_event_fd.
  * Params:
  *   @sync: AV sync module handle
  *   @cb: callback function
@@ -472,6 +676,74 @@ enum  clock_recovery_stat av_sync_get_clock_deviation(void *sync, int32_t *ppm);
  */
 int av_sync_set_underflow_check_cb(void *sync, underflow_detected cb, void *priv, struct underflow_config *cfg);
 
+/* Deliver pause pts and underflow callbacks from the caller's own loop.
+ * Callbacks never run on the av_sync_pop_frame thread. By default they
+ * run on a worker thread of the session. After this call, they run only
+ * inside av_sync_dispatch_events, which should be called whenever the
+ * returned fd becomes readable.
+ * Use by AV_SYNC_TYPE_VIDEO only.
+ * Params:
+ *   @sync: AV sync module handle
+ * Return:
+ *   eventfd to poll for POLLIN, or -1 for error
+ */
+int av_sync_get_event_fd(void *sync);
+
+/* Run pending callbacks on the calling thread, see av_sync_get_event_fd
+ * Params:
+ *   @sync: AV sync module handle
+ * Return:
+ *   number of callbacks run, or -1 for error
+ */
+int av_sync_dispatch_events(void *sync);
+
+/* set how often av_sync_audio_render reports audio timestamp to msync.
+ * A timestamp is always reported on the first render, after pause,
+ * discontinuity or audio switch.
+ * Use by AV_SYNC_TYPE_AUDIO only.
+ * Params:
+ *   @sync: AV sync module handle
+ *   @policy: publish policy, NULL use default value (200ms/20ms).
+ * Return:
+ *   0 for OK, or error code
+ */
+int av_sync_set_apts_publish_policy(void *sync, struct apts_publish_policy *policy);
+
+/* get runtime statistics of the session
+ * Params:
+ *   @sync: AV sync module handle
+ *   @stats: statistics returned
+ * Return:
+ *   0 for OK, or error code
+ */
+int av_sync_get_stats(void *sync, struct av_sync_stats *stats);
+
+/* Force a refresh of the session state mirror from msync.
+ * av_sync_pause(), av_sync_set_audio_switch() and av_sync_get_audio_switch()
+ * use a copy of the session state kept up to date by msync notifications.
+ * Call this before them when the state must not lag behind the driver.
+ * Params:
+ *   @sync: AV sync module handle
+ *   @gen: optional, mirror generation after the refresh
+ * Return:
+ *   0 for OK, or error code
+ */
+int av_sync_refresh_state(void *sync, uint32_t *gen);
+
+/* Get generation of the session state mirror.
+ * It increases on every update, 0 means nothing mirrored yet.
+ * Audio handles keep the mirror by notification only in A-master,
+ * live modes or during audio switch. Otherwise (e.g. V-master or
+ * free run) every state query asks the driver and the generation
+ * moves only with those queries.
+ * Params:
+ *   @sync: AV sync module handle
+ *   @gen: mirror generation
+ * Return:
+ *   0 for OK, or error code
+ */
+int av_sync_get_state_gen(void *sync, uint32_t *gen);
+
 /* Cancel audio waiting.
  * When AV_SYNC_ASTART_ASYNC blocks a thread, use this API to unblock it.
  * audio_start_cb will be triggered with AV_SYNC_ASCB_STOP.
@@ -22,9 +22,14 @@
 
 #include <stdint.h>
 
+/* lock-free for one reader thread and one writer thread,
+ * holds up to max_len items
+ */
 void* create_q(int max_len);
 void destroy_q(void * queue);
 int queue_item(void *queue, void * item);
+/* queue all @n items or none of them */
+int queue_items(void *queue, void **items, int n);
 /*  cnt 0 for frist one in fifo, cnt 1 for 2nd one in fifo, etc */
 int peek_item(void *queue, void** p_item, uint32_t cnt);
 int dqueue_item(void *queue, void** p_item);
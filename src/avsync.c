@@ -18,12 +18,12 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/time.h>
 #include <poll.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/prctl.h>
 #include <sys/ioctl.h>
 #include <time.h>
 #include <unistd.h>
@@ -36,6 +36,9 @@
 #include "msync.h"
 #include <pthread.h>
 #include "pcr_monitor.h"
+#include "ppm_cache.h"
+#include "event_dispatch.h"
+#include "reactor.h"
 #include "aml_version.h"
 
 enum sync_state {
@@ -59,6 +62,8 @@ struct  av_sync_session {
     /* session id attached */
     int session_id;
     int fd;
+    /* wall snapshot shared by driver, NULL if not supported */
+    const void *wall_page;
     bool attached;
     enum sync_mode mode;
     /* for audio trickplay */
@@ -88,6 +93,8 @@ struct  av_sync_session {
     bool  paused;
     enum sync_state state;
     void *pattern_detector;
+    /* session sysfs nodes, kept open */
+    void *sysfs;
     void *frame_q;
 
     /* start control */
@@ -115,6 +122,13 @@ struct  av_sync_session {
     /* underflow */
     underflow_detected underflow_cb;
     void *underflow_cb_priv;
+    /* pause pts and underflow callbacks, off the VSYNC path */
+    void *event_dispatch;
+    bool event_fd_mode;
+
+    /* batched release of frames not for display */
+    free_frames_cb free_frames;
+    void *free_frames_priv;
     struct underflow_config underflow_cfg;
     struct timespec frame_last_update_time;
 
@@ -123,9 +137,14 @@ struct  av_sync_session {
     uint32_t sync_lost_cnt;
     struct timespec sync_lost_print_time;
 
-    pthread_t poll_thread;
+    /* session fd watched by reactor */
+    bool in_reactor;
+    /* live handles by session id, under glock */
+    bool registered;
+    struct av_sync_session *reg_next;
+    /* packed session state, see state_pack() */
+    uint64_t state_mirror;
     /* pcr master, IPTV only */
-    bool quit_poll;
     enum sync_mode active_mode;
     uint32_t disc_thres_min;
     uint32_t disc_thres_max;
@@ -141,8 +160,18 @@ struct  av_sync_session {
 
     //pcr monitor handle
     void *pcr_monitor;
+    enum pcr_estimator_type pcr_est;
     int ppm;
     bool ppm_adjusted;
+    /* demod SFO sampling, backs off while demod is not locked */
+    uint64_t sfo_next_ms;
+    uint32_t sfo_backoff_ms;
+    uint32_t sfo_reads;
+    bool sfo_done;
+    /* persisted ppm of the broadcast source, 0 key for none */
+    uint64_t clock_key;
+    bool ppm_cache_checked;
+    int32_t ppm_cached;
 
     //video FPS detection
     pts90K last_fpts;
@@ -160,9 +189,39 @@ struct  av_sync_session {
 
     /*system mono time for current vsync interrupt */
     uint64_t msys;
+
+    /* apts publish policy, intervals in 90K */
+    struct apts_publish_policy apts_policy;
+    pts90K apts_pub_pts;
+    int apts_pub_delta;
+    bool apts_pub_force;
+
+    struct av_sync_stats stats;
+
+    /* vpts of last toggled frame, sent with next vsync txn or
+     * before anything reads the position. Under lock.
+     */
+    struct pts_tri pending_vpts;
+    bool vpts_pending;
+    /* driver rejected AMSYNCS_IOC_VSYNC_TXN on this fd */
+    bool vsync_txn_off;
+
+    /* audio clock model, extrapolated from the last kernel wall */
+    pts90K aclk_wall;
+    uint64_t aclk_mono;
+    uint32_t aclk_rate;
+    int32_t aclk_ppm;
+    bool aclk_valid;
+    bool aclk_stalled;
+    /* re-anchor interval in ms, 0 always asks the kernel */
+    int aclk_interval;
+    int aclk_cur_interval;
+    /* set by session notify and pause, drop the anchor */
+    bool aclk_dirty;
 };
 
 #define MAX_FRAME_NUM 32
+#define MAX_FRAME_Q_DEPTH 256
 #define DEFAULT_START_THRESHOLD 2
 #define TIME_UNIT90K    (90000)
 #define DEFAULT_WALL_ADJ_THRES (TIME_UNIT90K / 10) //100ms
@@ -180,6 +239,35 @@ struct  av_sync_session {
 #define OUTLIER_MAX_CNT 8
 #define VALID_TS(x) ((x) != -1)
 #define UNDERFLOW_CHECK_THRESH_MS (100)
+#define AUDIO_CLK_INTERVAL_MS (50)
+#define AUDIO_CLK_MIN_INTERVAL_MS (5)
+#define AUDIO_CLK_MAX_ERR (900 / 2) //5ms
+#define APTS_PUBLISH_INTERVAL_MS (200)
+#define APTS_PUBLISH_DRIFT_MS (20)
+#define SESSION_OPEN_TIMEOUT_MS (200)
+#define MAX_POOL_SIZE 8
+
+/* handles kept warm for channel change */
+struct av_sync_pool {
+    pthread_mutex_t lock;
+    enum sync_type type;
+    struct av_sync_config config;
+    enum pcr_estimator_type pcr_est;
+    int size;
+    int cnt;
+    bool reactor_held;
+    struct av_sync_session *handles[MAX_POOL_SIZE];
+};
+
+/* AMSYNCS_IOC_GET_SYNC_STAT result, mirrored per session */
+struct session_state {
+    enum sync_mode active_mode;
+    enum internal_sync_stat stat;
+    bool v_active;
+    bool a_active;
+    bool v_timeout;
+    bool audio_switch;
+};
 
 static uint64_t time_diff (struct timespec *b, struct timespec *a);
 static bool frame_expire(struct av_sync_session* avsync,
@@ -191,13 +279,80 @@ static bool frame_expire(struct av_sync_session* avsync,
 static bool pattern_detect(struct av_sync_session* avsync,
         int cur_period,
         int last_period);
-static void * poll_thread(void * arg);
+static void session_notify(void *priv, uint32_t events);
+static void handle_free(struct av_sync_session *avsync);
+static int session_state_fetch(struct av_sync_session *avsync,
+        bool clean_poll, enum src_flag flag, struct session_state *st);
+static int session_state_get(struct av_sync_session *avsync,
+        bool refresh, struct session_state *st);
+static void session_state_store(struct av_sync_session *avsync,
+        const struct session_state *st);
+static int session_get_wall(struct av_sync_session *avsync,
+        uint32_t *wall, uint32_t *interval);
+static void audio_clock_get(struct av_sync_session *avsync, pts90K *systime);
+static void session_event(void *priv, int type, uint32_t pts);
+static void audio_clock_invalidate(struct av_sync_session *avsync);
+static void audio_publish_apts(struct av_sync_session *avsync,
+        pts90K systime, pts90K pts);
 static void trigger_audio_start_cb(struct av_sync_session *avsync,
         avs_ascb_reason reason);
 static struct vframe * video_mono_pop_frame(struct av_sync_session *avsync);
-static int video_mono_push_frame(struct av_sync_session *avsync, struct vframe *frame);
+static int video_mono_push_frame(struct av_sync_session *avsync,
+        struct vframe **frames, int n);
 
 pthread_mutex_t glock = PTHREAD_MUTEX_INITIALIZER;
+/* bound handles of this process, for by-id calls */
+static struct av_sync_session *registry;
+
+static void registry_add(struct av_sync_session *avsync)
+{
+    pthread_mutex_lock(&glock);
+    avsync->reg_next = registry;
+    registry = avsync;
+    avsync->registered = true;
+    pthread_mutex_unlock(&glock);
+}
+
+static void registry_remove(struct av_sync_session *avsync)
+{
+    struct av_sync_session **p;
+
+    if (!avsync->registered)
+        return;
+    pthread_mutex_lock(&glock);
+    for (p = &registry; *p; p = &(*p)->reg_next) {
+        if (*p == avsync) {
+            *p = avsync->reg_next;
+            break;
+        }
+    }
+    avsync->registered = false;
+    pthread_mutex_unlock(&glock);
+}
+
+/* With glock held. Any handle will do, they share the kernel session */
+static struct av_sync_session *registry_find(int session_id)
+{
+    struct av_sync_session *avsync;
+
+    for (avsync = registry; avsync; avsync = avsync->reg_next)
+        if (avsync->session_id == session_id)
+            return avsync;
+    return NULL;
+}
+
+/* Session @id of another process, or not created yet.
+ * Goes through a temporary fd.
+ */
+static int session_open_tmp(int id)
+{
+    int fd;
+
+    fd = msync_session_open(id);
+    if (fd < 0)
+        log_error("open /dev/%s%d errno %d", SESSION_DEV, id, errno);
+    return fd;
+}
 
 int av_sync_open_session(int *session_id)
 {
@@ -210,7 +365,7 @@ int av_sync_open_session(int *session_id)
         log_error("fail");
         goto exit;
     }
-    rc = ioctl(fd, AMSYNC_IOC_ALLOC_SESSION, &id);
+    rc = msync_alloc_session(fd, &id);
     if (rc) {
         log_error("new session errno:%d", errno);
         msync_destory_session(fd);
@@ -231,86 +386,167 @@ void av_sync_close_session(int session)
     pthread_mutex_unlock(&glock);
 }
 
-static void* create_internal(int session_id,
-        enum sync_mode mode,
-        enum sync_type type,
-        int start_thres,
-        bool attach)
+static enum pcr_estimator_type pcr_estimator_of(
+        const struct av_sync_config *config)
 {
-    struct av_sync_session *avsync = NULL;
-    char dev_name[20];
-    int retry = 10;
+    const char *env;
+
+    if (config && config->clk_recovery == CLK_RECOVERY_ALGO_LSQ)
+        return PCR_EST_LSQ;
+    if (config && config->clk_recovery == CLK_RECOVERY_ALGO_KALMAN)
+        return PCR_EST_KALMAN;
+    if (config && config->clk_recovery == CLK_RECOVERY_ALGO_GROUP)
+        return PCR_EST_GROUP;
+    env = getenv("AML_AVSYNC_CLK_RECOVERY");
+    if (env && !strcmp(env, "lsq"))
+        return PCR_EST_LSQ;
+    if (env && !strcmp(env, "kalman"))
+        return PCR_EST_KALMAN;
+    return PCR_EST_GROUP;
+}
 
-    /* debug log level */
-    {
-      const char *env= getenv( "AML_AVSYNC_DEBUG_LEVEL");
-      if ( env ) {
-        log_set_level(atoi(env));
-      }
-    }
+/* Session independent resources of a handle, the pool keeps them */
+static struct av_sync_session *handle_alloc(enum sync_type type,
+        const struct av_sync_config *config)
+{
+    struct av_sync_session *avsync;
 
-    log_info("[%d] mode %d type %d", session_id, mode, type);
     avsync = (struct av_sync_session *)calloc(1, sizeof(*avsync));
     if (!avsync) {
         log_error("OOM");
         return NULL;
     }
+    avsync->type = type;
+    avsync->fd = -1;
+
+    avsync->stats.frame_q_depth = MAX_FRAME_NUM;
+    if (config && config->frame_queue_depth) {
+        if (config->frame_queue_depth < 0 ||
+                config->frame_queue_depth > MAX_FRAME_Q_DEPTH) {
+            log_error("invalid queue depth: %d", config->frame_queue_depth);
+            goto err;
+        }
+        avsync->stats.frame_q_depth = config->frame_queue_depth;
+    }
+
+    if (type == AV_SYNC_TYPE_VIDEO) {
+        /* pattern detector depends on the output mode, see session_bind */
+        avsync->frame_q = create_q(avsync->stats.frame_q_depth);
+        if (!avsync->frame_q) {
+            log_error("create queue fail");
+            goto err;
+        }
+        avsync->event_dispatch = event_dispatch_create(session_event, avsync);
+        if (!avsync->event_dispatch) {
+            log_error("create event dispatch fail");
+            goto err;
+        }
+    } else if (type == AV_SYNC_TYPE_PCR) {
+        avsync->pcr_est = pcr_estimator_of(config);
+        if (pcr_monitor_init_ex(&avsync->pcr_monitor, avsync->pcr_est)) {
+            log_error("pcr monitor init");
+            goto err;
+        }
+    }
+    return avsync;
+
+err:
+    handle_free(avsync);
+    return NULL;
+}
+
+static void handle_free(struct av_sync_session *avsync)
+{
+    if (avsync->frame_q)
+        destroy_q(avsync->frame_q);
+    event_dispatch_destroy(avsync->event_dispatch);
+    if (avsync->pattern_detector)
+        destroy_pattern_detector(avsync->pattern_detector);
+    if (avsync->pcr_monitor)
+        pcr_monitor_destroy(avsync->pcr_monitor);
+    free(avsync);
+}
 
-    if (type == AV_SYNC_TYPE_VIDEO &&
+/* Recycle an unbound handle, everything but its resources is
+ * cleared as if just allocated.
+ */
+static void handle_reset(struct av_sync_session *avsync)
+{
+    struct av_sync_session keep = *avsync;
+
+    memset(avsync, 0, sizeof(*avsync));
+    avsync->type = keep.type;
+    avsync->fd = -1;
+    avsync->stats.frame_q_depth = keep.stats.frame_q_depth;
+    avsync->frame_q = keep.frame_q;
+    avsync->event_dispatch = keep.event_dispatch;
+    avsync->pattern_detector = keep.pattern_detector;
+    avsync->pcr_monitor = keep.pcr_monitor;
+    avsync->pcr_est = keep.pcr_est;
+
+    if (avsync->pcr_monitor)
+        pcr_monitor_recycle(avsync->pcr_monitor);
+}
+
+/* Attach handle to kernel session @session_id */
+static int session_bind(struct av_sync_session *avsync,
+        int session_id,
+        enum sync_mode mode,
+        int start_thres,
+        bool attach,
+        struct timespec *start)
+{
+    struct session_state st;
+    struct timespec t, now;
+    char dev_name[20];
+
+    log_info("[%d] mode %d type %d", session_id, mode, avsync->type);
+    if (avsync->type == AV_SYNC_TYPE_VIDEO &&
             mode == AV_SYNC_MODE_VIDEO_MONO) {
       if (session_id < AV_SYNC_SESSION_V_MONO) {
           log_error("wrong session id %d", session_id);
-          goto err;
+          return -1;
       }
-      avsync->type = type;
       avsync->mode = mode;
-      avsync->fd = -1;
       avsync->session_id = session_id;
       log_info("[%d]init", avsync->session_id);
-      return avsync;
+      return 0;
     }
 
-    if (type == AV_SYNC_TYPE_VIDEO) {
+    if (avsync->type == AV_SYNC_TYPE_VIDEO) {
         int32_t interval = 1500;
 
+        /* output mode may have changed since the handle was pooled */
         if (msync_session_get_vsync_interval(&interval))
             log_error("read interval error");
-        avsync->pattern_detector = create_pattern_detector(interval);
+        if (recycle_pattern_detector(avsync->pattern_detector, interval)) {
+            /* none yet, or output mode crossed 100Hz */
+            destroy_pattern_detector(avsync->pattern_detector);
+            avsync->pattern_detector = create_pattern_detector(interval);
+        }
         if (!avsync->pattern_detector) {
             log_error("pd create fail");
-            goto err;
+            return -1;
         }
-
         if (!start_thres)
             avsync->start_thres = DEFAULT_START_THRESHOLD;
         else {
             if (start_thres > 5) {
                 log_error("start_thres too big: %d", start_thres);
-                goto err2;
+                return -1;
             }
             avsync->start_thres = start_thres;
         }
+        if (avsync->stats.frame_q_depth < avsync->start_thres) {
+            log_error("queue depth %u below start_thres %d",
+                    avsync->stats.frame_q_depth, avsync->start_thres);
+            return -1;
+        }
         avsync->phase_set = false;
         avsync->phase_adjusted = false;
         avsync->first_frame_toggled = false;
-
-        avsync->frame_q = create_q(MAX_FRAME_NUM);
-        if (!avsync->frame_q) {
-            log_error("[%d]create queue fail", avsync->session_id);
-            goto err2;
-        }
-        {
-            int ret;
-
-            ret = pthread_create(&avsync->poll_thread, NULL, poll_thread, avsync);
-            if (ret) {
-                log_error("[%d]create poll thread errno %d", avsync->session_id, errno);
-                goto err2;
-            }
-        }
     }
 
-    avsync->type = type;
     avsync->state = AV_SYNC_STAT_INIT;
     avsync->paused = false;
     avsync->session_id = session_id;
@@ -326,11 +562,18 @@ static void* create_internal(int session_id,
     avsync->last_q_pts = -1;
     avsync->last_wall = -1;
     avsync->fps_interval = -1;
+    avsync->aclk_interval = AUDIO_CLK_INTERVAL_MS;
+    avsync->aclk_cur_interval = AUDIO_CLK_INTERVAL_MS;
+    avsync->apts_policy.min_interval = APTS_PUBLISH_INTERVAL_MS;
+    avsync->apts_policy.max_drift = APTS_PUBLISH_DRIFT_MS;
+    avsync->apts_pub_force = true;
     avsync->last_r_syst = -1;
     avsync->timeout = -1;
     avsync->apts = AV_SYNC_INVALID_PTS;
 
-    if (msync_session_get_disc_thres(session_id,
+    snprintf(dev_name, sizeof(dev_name), "/dev/%s%d", SESSION_DEV, session_id);
+    avsync->sysfs = msync_session_sysfs_open(session_id);
+    if (msync_session_get_disc_thres(avsync->sysfs,
                 &avsync->disc_thres_min, &avsync->disc_thres_max)) {
         log_error("dev_name:%s; errno:%d; fail to get disc thres", dev_name, errno);
         avsync->disc_thres_min = AV_DISC_THRES_MIN;
@@ -341,27 +584,17 @@ static void* create_internal(int session_id,
     log_info("[%d] start_thres %d disc_thres %u/%u", session_id,
         start_thres, avsync->disc_thres_min, avsync->disc_thres_max);
 
-    snprintf(dev_name, sizeof(dev_name), "/dev/%s%d", SESSION_DEV, session_id);
-    while (retry) {
-        /* wait for sysfs to update */
-        avsync->fd = open(dev_name, O_RDONLY | O_CLOEXEC);
-        if (avsync->fd > 0)
-            break;
-
-        retry--;
-        if (!retry) {
-          log_error("open %s errno %d", dev_name, errno);
-          goto err2;
-        }
-        usleep(20000);
+    /* node shows up after allocation, wait for it */
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    avsync->fd = msync_session_open_wait(session_id, SESSION_OPEN_TIMEOUT_MS);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    avsync->stats.dev_wait_us = time_diff(&now, &t);
+    if (avsync->fd < 0) {
+        log_error("open %s errno %d", dev_name, errno);
+        goto err;
     }
 
-    if (avsync->type == AV_SYNC_TYPE_PCR) {
-        if (pcr_monitor_init(&avsync->pcr_monitor)) {
-            log_error("pcr monitor init");
-            goto err3;
-        }
-    }
+    avsync->wall_page = msync_session_map_wall(avsync->fd);
 
     if (!attach) {
         msync_session_set_mode(avsync->fd, mode);
@@ -374,17 +607,17 @@ static void* create_internal(int session_id,
         avsync->attached = true;
         if (msync_session_get_mode(avsync->fd, &avsync->mode)) {
             log_error("get mode");
-            goto err4;
+            goto err;
         }
         avsync->backup_mode = avsync->mode;
         if (msync_session_get_start_policy(avsync->fd, &avsync->start_policy, &avsync->timeout)) {
             log_error("get policy");
-            goto err4;
+            goto err;
         }
-        if (msync_session_get_stat(avsync->fd, false, &avsync->active_mode, NULL,
-                NULL, NULL, NULL, &avsync->in_audio_switch, SRC_A)) {
+        /* new handle, seed the mirror */
+        if (session_state_fetch(avsync, false, SRC_A, &st)) {
             log_error("get state");
-            goto err4;
+            goto err;
         }
         if (avsync->in_audio_switch) {
             log_info("audio_switch_state reseted the audio");
@@ -395,26 +628,60 @@ static void* create_internal(int session_id,
             session_id, avsync->mode, avsync->start_policy);
     }
 
-    return avsync;
-err4:
-    if (avsync->pcr_monitor)
-        pcr_monitor_destroy(avsync->pcr_monitor);
-err3:
-    if (avsync->fd)
-        close(avsync->fd);
-err2:
-    avsync->quit_poll = true;
-    if (avsync->poll_thread) {
-        pthread_join(avsync->poll_thread, NULL);
-        avsync->poll_thread = 0;
+    if (avsync->type == AV_SYNC_TYPE_VIDEO) {
+        if (reactor_add(avsync->fd, session_notify, avsync)) {
+            log_error("[%d]watch session fail", avsync->session_id);
+            goto err;
+        }
+        avsync->in_reactor = true;
     }
-    if (avsync->frame_q)
-        destroy_q(avsync->frame_q);
-    if (avsync->pattern_detector)
-        destroy_pattern_detector(avsync->pattern_detector);
+
+    registry_add(avsync);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    avsync->stats.create_us = time_diff(&now, start);
+    log_info("[%d] ready in %u us, device wait %u us", session_id,
+            avsync->stats.create_us, avsync->stats.dev_wait_us);
+    return 0;
+
 err:
-    free(avsync);
-    return NULL;
+    msync_session_unmap_wall(avsync->wall_page);
+    avsync->wall_page = NULL;
+    if (avsync->fd >= 0)
+        msync_session_close(avsync->fd);
+    avsync->fd = -1;
+    msync_session_sysfs_close(avsync->sysfs);
+    avsync->sysfs = NULL;
+    pthread_mutex_destroy(&avsync->lock);
+    return -1;
+}
+
+static void* create_internal(int session_id,
+        enum sync_mode mode,
+        enum sync_type type,
+        int start_thres,
+        bool attach,
+        const struct av_sync_config *config)
+{
+    struct av_sync_session *avsync;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    /* debug log level */
+    {
+      const char *env= getenv( "AML_AVSYNC_DEBUG_LEVEL");
+      if ( env ) {
+        log_set_level(atoi(env));
+      }
+    }
+
+    avsync = handle_alloc(type, config);
+    if (!avsync)
+        return NULL;
+    if (session_bind(avsync, session_id, mode, start_thres, attach, &start)) {
+        handle_free(avsync);
+        return NULL;
+    }
+    return avsync;
 }
 
 void* av_sync_create(int session_id,
@@ -423,7 +690,17 @@ void* av_sync_create(int session_id,
         int start_thres)
 {
     return create_internal(session_id, mode,
-            type, start_thres, false);
+            type, start_thres, false, NULL);
+}
+
+void* av_sync_create_ex(int session_id,
+        enum sync_mode mode,
+        enum sync_type type,
+        int start_thres,
+        const struct av_sync_config *config)
+{
+    return create_internal(session_id, mode,
+            type, start_thres, false, config);
 }
 
 void* av_sync_attach(int session_id, enum sync_type type)
@@ -431,7 +708,7 @@ void* av_sync_attach(int session_id, enum sync_type type)
     if (type == AV_SYNC_TYPE_VIDEO)
         return NULL;
     return create_internal(session_id, AV_SYNC_MODE_MAX,
-            type, 0, true);
+            type, 0, true, NULL);
 }
 
 int av_sync_video_config(void *sync, struct video_config* config)
@@ -454,47 +731,80 @@ int av_sync_video_config(void *sync, struct video_config* config)
     return 0;
 }
 
+/* outside of avsync->lock, callbacks may take decoder locks */
+static void release_frames(struct av_sync_session *avsync,
+        struct vframe **frames, int n, avs_free_reason reason)
+{
+    int i;
+
+    if (!n)
+        return;
+    if (avsync->free_frames) {
+        avsync->free_frames(frames, n, reason, avsync->free_frames_priv);
+        return;
+    }
+    for (i = 0; i < n; i++)
+        frames[i]->free(frames[i]);
+}
+
+/* With avsync->lock held. Position readers must not see a frame
+ * one vsync old.
+ */
+static void video_flush_vpts(struct av_sync_session *avsync)
+{
+    if (!avsync->vpts_pending)
+        return;
+    msync_session_set_vts(avsync->fd, &avsync->pending_vpts);
+    avsync->vpts_pending = false;
+}
+
 static int internal_stop(struct av_sync_session *avsync)
 {
-    int ret = 0;
-    struct vframe *frame;
+    int ret = 0, n = 0;
+    struct vframe *frames[MAX_FRAME_Q_DEPTH];
 
     pthread_mutex_lock(&avsync->lock);
-    while (!dqueue_item(avsync->frame_q, (void **)&frame)) {
-        frame->free(frame);
-    }
+    video_flush_vpts(avsync);
+    while (n < MAX_FRAME_Q_DEPTH &&
+            !dqueue_item(avsync->frame_q, (void **)&frames[n]))
+        n++;
     avsync->state = AV_SYNC_STAT_INIT;
     pthread_mutex_unlock(&avsync->lock);
+    release_frames(avsync, frames, n, AV_SYNC_FREE_FLUSH);
     return ret;
 }
 
-/* destroy and detach from kernel session */
-void av_sync_destroy(void *sync)
+/* Detach handle from its kernel session, resources are kept */
+static void session_unbind(struct av_sync_session *avsync)
 {
-    struct av_sync_session *avsync = (struct av_sync_session *)sync;
-
-    if (!avsync)
-        return;
-
     if (avsync->type == AV_SYNC_TYPE_VIDEO &&
             avsync->mode == AV_SYNC_MODE_VIDEO_MONO) {
         log_info("[%d]done", avsync->session_id);
         internal_stop(avsync);
-        destroy_q(avsync->frame_q);
-        free(avsync);
         return;
     }
     log_info("[%d]begin type %d", avsync->session_id, avsync->type);
-    if (avsync->type == AV_SYNC_TYPE_VIDEO)
+    /* by-id calls stop using our fd */
+    registry_remove(avsync);
+    if (avsync->type == AV_SYNC_TYPE_VIDEO) {
+        log_info("[%d]frame queue high watermark %u of %u", avsync->session_id,
+                avsync->stats.frame_q_high_watermark, avsync->stats.frame_q_depth);
         internal_stop(avsync);
+        /* delivers what is still pending, or drops it from a callback */
+        event_dispatch_reset(avsync->event_dispatch);
+    }
 
-    avsync->quit_poll = true;
-    if (avsync->poll_thread) {
-        pthread_join(avsync->poll_thread, NULL);
-        avsync->poll_thread = 0;
+    if (avsync->in_reactor) {
+        reactor_remove(avsync->fd);
+        avsync->in_reactor = false;
     }
-    if (avsync->type == AV_SYNC_TYPE_AUDIO)
+    if (avsync->type == AV_SYNC_TYPE_AUDIO) {
         trigger_audio_start_cb(avsync, AV_SYNC_ASCB_STOP);
+        if (avsync->stats.apts_render_cnt)
+            log_info("[%d]apts published %llu of %llu renders", avsync->session_id,
+                    (unsigned long long)avsync->stats.apts_publish_cnt,
+                    (unsigned long long)avsync->stats.apts_render_cnt);
+    }
 
     if (avsync->session_started) {
         if (avsync->type == AV_SYNC_TYPE_VIDEO)
@@ -503,17 +813,138 @@ void av_sync_destroy(void *sync)
             msync_session_set_audio_stop(avsync->fd);
     }
 
-    if(avsync->pcr_monitor)
-        pcr_monitor_destroy(avsync->pcr_monitor);
-
-    close(avsync->fd);
+    msync_session_unmap_wall(avsync->wall_page);
+    msync_session_sysfs_close(avsync->sysfs);
+    msync_session_close(avsync->fd);
     pthread_mutex_destroy(&avsync->lock);
-    if (avsync->type == AV_SYNC_TYPE_VIDEO) {
-        destroy_q(avsync->frame_q);
-        destroy_pattern_detector(avsync->pattern_detector);
-    }
     log_info("[%d]done type %d", avsync->session_id, avsync->type);
-    free(avsync);
+}
+
+/* destroy and detach from kernel session */
+void av_sync_destroy(void *sync)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync)
+        return;
+
+    session_unbind(avsync);
+    handle_free(avsync);
+}
+
+void* av_sync_pool_create(enum sync_type type, int size,
+        const struct av_sync_config *config)
+{
+    struct av_sync_pool *pool;
+
+    if (size <= 0 || size > MAX_POOL_SIZE) {
+        log_error("invalid pool size %d", size);
+        return NULL;
+    }
+    pool = (struct av_sync_pool *)calloc(1, sizeof(*pool));
+    if (!pool) {
+        log_error("OOM");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->type = type;
+    if (config)
+        pool->config = *config;
+    pool->pcr_est = pcr_estimator_of(config);
+    /* no thread start and stop on every channel change */
+    if (reactor_hold()) {
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        return NULL;
+    }
+    pool->reactor_held = true;
+
+    for (pool->cnt = 0; pool->cnt < size; pool->cnt++) {
+        pool->handles[pool->cnt] = handle_alloc(type, config);
+        if (!pool->handles[pool->cnt]) {
+            av_sync_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    pool->size = size;
+    log_info("pool type %d size %d", type, size);
+    return pool;
+}
+
+void av_sync_pool_destroy(void *pool)
+{
+    struct av_sync_pool *p = (struct av_sync_pool *)pool;
+
+    if (!p)
+        return;
+    while (p->cnt)
+        handle_free(p->handles[--p->cnt]);
+    if (p->reactor_held)
+        reactor_release();
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+/* back to pool if there is room for it */
+static void pool_release(struct av_sync_pool *p,
+        struct av_sync_session *avsync)
+{
+    handle_reset(avsync);
+    pthread_mutex_lock(&p->lock);
+    if (p->cnt < p->size && avsync->type == p->type &&
+            avsync->stats.frame_q_depth == (p->config.frame_queue_depth ?
+                (uint32_t)p->config.frame_queue_depth : MAX_FRAME_NUM) &&
+            (avsync->type != AV_SYNC_TYPE_PCR ||
+             avsync->pcr_est == p->pcr_est)) {
+        p->handles[p->cnt++] = avsync;
+        avsync = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (avsync)
+        handle_free(avsync);
+}
+
+void* av_sync_pool_get(void *pool, int session_id,
+        enum sync_mode mode, int start_thres)
+{
+    struct av_sync_pool *p = (struct av_sync_pool *)pool;
+    struct av_sync_session *avsync = NULL;
+    struct timespec start;
+
+    if (!p)
+        return NULL;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    pthread_mutex_lock(&p->lock);
+    if (p->cnt)
+        avsync = p->handles[--p->cnt];
+    pthread_mutex_unlock(&p->lock);
+    if (!avsync) {
+        log_warn("[%d] pool empty, allocating", session_id);
+        avsync = handle_alloc(p->type, &p->config);
+        if (!avsync)
+            return NULL;
+    }
+
+    if (session_bind(avsync, session_id, mode, start_thres, false, &start)) {
+        pool_release(p, avsync);
+        return NULL;
+    }
+    return avsync;
+}
+
+void av_sync_pool_put(void *pool, void *sync)
+{
+    struct av_sync_pool *p = (struct av_sync_pool *)pool;
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync)
+        return;
+    if (!p) {
+        av_sync_destroy(avsync);
+        return;
+    }
+    session_unbind(avsync);
+    pool_release(p, avsync);
 }
 
 int avs_sync_set_start_policy(void *sync, struct start_policy* st_policy)
@@ -548,7 +979,7 @@ int avs_sync_set_start_policy(void *sync, struct start_policy* st_policy)
 int av_sync_pause(void *sync, bool pause)
 {
     struct av_sync_session *avsync = (struct av_sync_session *)sync;
-    bool v_active, a_active, v_timeout;
+    struct session_state st;
     int rc;
 
     if (!avsync) {
@@ -566,9 +997,7 @@ int av_sync_pause(void *sync, bool pause)
         return -1;
     }
 
-     rc = msync_session_get_stat(avsync->fd, false, &avsync->active_mode, NULL,
-                &v_active, &a_active, &v_timeout,
-                &avsync->in_audio_switch, SRC_A);
+    rc = session_state_get(avsync, false, &st);
 
     /* ignore only when video try to pause when audio is acive, on which
        the control of the STC will be relays.
@@ -577,7 +1006,7 @@ int av_sync_pause(void *sync, bool pause)
        We shall not igore that otherwise it could cause video freeze.       */
     if (avsync->mode == AV_SYNC_MODE_AMASTER &&
         avsync->type == AV_SYNC_TYPE_VIDEO &&
-        a_active &&
+        st.a_active &&
         !avsync->in_audio_switch) {
         if (!pause) {
             log_info("[%d] clear video pause when audio active",
@@ -596,8 +1025,16 @@ int av_sync_pause(void *sync, bool pause)
         return 0;
     }
 
+    if (avsync->type == AV_SYNC_TYPE_VIDEO) {
+        /* no vsync txn follows while paused */
+        pthread_mutex_lock(&avsync->lock);
+        video_flush_vpts(avsync);
+        pthread_mutex_unlock(&avsync->lock);
+    }
     rc = msync_session_set_pause(avsync->fd, pause);
     avsync->paused = pause;
+    audio_clock_invalidate(avsync);
+    avsync->apts_pub_force = true;
     log_info("[%d]paused:%d type:%d rc %d",
         avsync->session_id, pause, avsync->type, rc);
     if (!avsync->paused && avsync->first_frame_toggled) {
@@ -607,54 +1044,30 @@ int av_sync_pause(void *sync, bool pause)
     return rc;
 }
 
-int av_sync_push_frame(void *sync , struct vframe *frame)
+/* producer side only */
+static inline void update_q_watermark(struct av_sync_session *avsync)
 {
-    int ret;
-    struct vframe *prev = NULL;
-    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+    uint32_t size = queue_size(avsync->frame_q);
 
-    if (!avsync)
-        return -1;
-
-    if (avsync->type == AV_SYNC_TYPE_VIDEO &&
-            avsync->mode == AV_SYNC_MODE_VIDEO_MONO) {
-        return video_mono_push_frame(avsync, frame);
-    }
-
-    if (avsync->state == AV_SYNC_STAT_INIT && !queue_size(avsync->frame_q)) {
-        /* policy should be final now */
-        if (msync_session_get_start_policy(avsync->fd, &avsync->start_policy, &avsync->timeout)) {
-            log_error("[%d]get policy", avsync->session_id);
-            return -1;
-        }
-    }
+    if (size > avsync->stats.frame_q_high_watermark)
+        avsync->stats.frame_q_high_watermark = size;
+}
 
+/* per frame bookkeeping before queueing, false if the frame is dropped */
+static bool push_check_frame(struct av_sync_session *avsync,
+        struct vframe *frame, int *max_gap)
+{
     if (avsync->last_q_pts != -1) {
         if (frame->pts != -1 && avsync->mode == AV_SYNC_MODE_VMASTER) {
-            /* Sometimes app will fake PTS for trickplay, video PTS gap
-             * is really big depending on the speed. Have to adjust the
-             * threshold dynamically.
-             */
             int gap = (int)(frame->pts - avsync->last_q_pts);
-            if (gap > avsync->disc_thres_min) {
-                avsync->disc_thres_min = gap * 6;
-                avsync->disc_thres_max = gap * 20;
-                msync_session_set_wall_adj_thres(avsync->fd, avsync->disc_thres_min);
-                msync_session_set_disc_thres(avsync->session_id,
-                        avsync->disc_thres_min, avsync->disc_thres_max);
-                log_info("[%d] update disc_thres to %d/%d",avsync->session_id,
-                        avsync->disc_thres_min, avsync->disc_thres_max);
-            }
+
+            if (gap > *max_gap)
+                *max_gap = gap;
         }
         if (avsync->last_q_pts == frame->pts && avsync->mode == AV_SYNC_MODE_AMASTER) {
-            /* TODO: wrong, should remove from back of queue */
-            pthread_mutex_lock(&avsync->lock);
-            dqueue_item(avsync->frame_q, (void **)&prev);
-            if (prev) {
-                prev->free(prev);
-                log_info ("[%d]drop frame with same pts %u", avsync->session_id, frame->pts);
-            }
-            pthread_mutex_unlock(&avsync->lock);
+            /* queue tail belongs to the reader, drop the new one instead */
+            log_info ("[%d]drop frame with same pts %u", avsync->session_id, frame->pts);
+            return false;
         } else if (avsync->fps_cnt < 100) {
             int32_t interval = frame->pts - avsync->last_q_pts;
 
@@ -677,17 +1090,100 @@ int av_sync_push_frame(void *sync , struct vframe *frame)
         frame->duration = 0;
     frame->hold_period = 0;
     avsync->last_q_pts = frame->pts;
-    ret = queue_item(avsync->frame_q, frame);
+    return true;
+}
+
+static int push_frames(struct av_sync_session *avsync,
+        struct vframe **frames, int n)
+{
+    int i, cnt = 0, max_gap = 0, drop_cnt = 0;
+    struct vframe *dropped[MAX_FRAME_Q_DEPTH];
+
+    if (avsync->state == AV_SYNC_STAT_INIT && !queue_size(avsync->frame_q)) {
+        /* policy should be final now */
+        if (msync_session_get_start_policy(avsync->fd, &avsync->start_policy, &avsync->timeout)) {
+            log_error("[%d]get policy", avsync->session_id);
+            return -1;
+        }
+    }
+
+    /* nothing is consumed unless the whole batch fits */
+    if (queue_size(avsync->frame_q) + n > avsync->stats.frame_q_depth) {
+        log_error("[%d]queue fail: %d + %d", avsync->session_id,
+                queue_size(avsync->frame_q), n);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (push_check_frame(avsync, frames[i], &max_gap))
+            frames[cnt++] = frames[i];
+        else
+            dropped[drop_cnt++] = frames[i];
+    }
+    release_frames(avsync, dropped, drop_cnt, AV_SYNC_FREE_DUPLICATE);
+
+    /* Sometimes app will fake PTS for trickplay, video PTS gap
+     * is really big depending on the speed. Have to adjust the
+     * threshold dynamically.
+     */
+    if (max_gap > avsync->disc_thres_min) {
+        avsync->disc_thres_min = max_gap * 6;
+        avsync->disc_thres_max = max_gap * 20;
+        msync_session_set_wall_adj_thres(avsync->fd, avsync->disc_thres_min);
+        msync_session_set_disc_thres(avsync->sysfs,
+                avsync->disc_thres_min, avsync->disc_thres_max);
+        log_info("[%d] update disc_thres to %d/%d",avsync->session_id,
+                avsync->disc_thres_min, avsync->disc_thres_max);
+    }
+
+    if (queue_items(avsync->frame_q, (void **)frames, cnt)) {
+        log_error("[%d]queue fail", avsync->session_id);
+        return -1;
+    }
+    update_q_watermark(avsync);
     if (avsync->state == AV_SYNC_STAT_INIT &&
         queue_size(avsync->frame_q) >= avsync->start_thres) {
         avsync->state = AV_SYNC_STAT_RUNNING;
         log_debug("[%d]state: init --> running", avsync->session_id);
     }
 
-    if (ret)
-        log_error("queue fail:%d", ret);
-    log_debug("[%d]push %u, QNum=%d", avsync->session_id, frame->pts, queue_size(avsync->frame_q));
-    return ret;
+    if (cnt)
+        log_debug("[%d]push %u..%u, QNum=%d", avsync->session_id,
+                frames[0]->pts, frames[cnt - 1]->pts, queue_size(avsync->frame_q));
+    return 0;
+}
+
+int av_sync_push_frame(void *sync , struct vframe *frame)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync)
+        return -1;
+
+    if (avsync->type == AV_SYNC_TYPE_VIDEO &&
+            avsync->mode == AV_SYNC_MODE_VIDEO_MONO) {
+        return video_mono_push_frame(avsync, &frame, 1);
+    }
+
+    return push_frames(avsync, &frame, 1);
+}
+
+int av_sync_push_frames(void *sync, struct vframe **frames, int n)
+{
+    struct vframe *batch[MAX_FRAME_Q_DEPTH];
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync || !frames || n <= 0 || n > MAX_FRAME_Q_DEPTH)
+        return -1;
+
+    /* dropped frames are compacted out, keep caller array intact */
+    memcpy(batch, frames, n * sizeof(*frames));
+    if (avsync->type == AV_SYNC_TYPE_VIDEO &&
+            avsync->mode == AV_SYNC_MODE_VIDEO_MONO) {
+        return video_mono_push_frame(avsync, batch, n);
+    }
+
+    return push_frames(avsync, batch, n);
 }
 
 struct vframe *av_sync_pop_frame(void *sync)
@@ -698,6 +1194,9 @@ struct vframe *av_sync_pop_frame(void *sync)
     uint32_t systime = 0;
     bool pause_pts_reached = false;
     uint32_t interval = 0;
+    bool check_start, clock_started = false;
+    struct vframe *dropped[MAX_FRAME_Q_DEPTH];
+    int drop_cnt = 0;
 
     if (avsync->type == AV_SYNC_TYPE_VIDEO &&
             avsync->mode == AV_SYNC_MODE_VIDEO_MONO)
@@ -716,7 +1215,7 @@ struct vframe *av_sync_pop_frame(void *sync)
             log_info("[%d]empty q", avsync->session_id);
             goto exit;
         }
-        msync_session_get_wall(avsync->fd, &systime, &interval);
+        session_get_wall(avsync, &systime, &interval);
         pts = frame->pts - avsync->delay * interval;
         msync_session_set_video_start(avsync->fd, pts);
         avsync->session_started = true;
@@ -724,16 +1223,25 @@ struct vframe *av_sync_pop_frame(void *sync)
             avsync->session_id, pts, frame->pts, systime);
     }
 
-    if (avsync->start_policy == AV_SYNC_START_ALIGN &&
-            !avsync->first_frame_toggled &&
-            !msync_clock_started(avsync->fd)) {
+    check_start = avsync->start_policy == AV_SYNC_START_ALIGN &&
+            !avsync->first_frame_toggled;
+    if (avsync->vpts_pending || check_start) {
+        /* one kernel crossing: previous vpts in, wall out */
+        msync_session_vsync_txn(avsync->fd, &avsync->vsync_txn_off,
+                avsync->vpts_pending ? &avsync->pending_vpts : NULL,
+                &systime, &interval, check_start ? &clock_started : NULL);
+        avsync->vpts_pending = false;
+    } else {
+        session_get_wall(avsync, &systime, &interval);
+    }
+
+    if (check_start && !clock_started) {
         pthread_mutex_unlock(&avsync->lock);
         log_trace("[%d]clock not started", avsync->session_id);
         return NULL;
     }
 
     enter_last_frame = avsync->last_frame;
-    msync_session_get_wall(avsync->fd, &systime, &interval);
 
     /* handle refresh rate change */
     if (avsync->vsync_interval == AV_SYNC_INVALID_PAUSE_PTS ||
@@ -782,7 +1290,15 @@ struct vframe *av_sync_pop_frame(void *sync)
                              avsync->last_frame->pts, frame->pts,
                              systime, systime - avsync->last_poptime,
                              qsize);
-                    avsync->last_frame->free(avsync->last_frame);
+                    /* producer is lock free and may outrun the batch,
+                     * rare enough to free under the lock
+                     */
+                    if (drop_cnt == MAX_FRAME_Q_DEPTH) {
+                        release_frames(avsync, dropped, drop_cnt,
+                                AV_SYNC_FREE_DROPPED);
+                        drop_cnt = 0;
+                    }
+                    dropped[drop_cnt++] = avsync->last_frame;
                 }
             } else {
                 avsync->first_frame_toggled = true;
@@ -814,14 +1330,13 @@ struct vframe *av_sync_pop_frame(void *sync)
             avsync->session_id, avsync->pause_pts);
         avsync->pause_pts = AV_SYNC_INVALID_PAUSE_PTS;
         if (avsync->pause_pts_cb)
-            avsync->pause_pts_cb(local_pts,
-                    avsync->pause_cb_priv);
-        log_info ("[%d] reach pause pts: %u handle done",
-            avsync->session_id, local_pts);
+            event_dispatch_post(avsync->event_dispatch,
+                    SESSION_EVT_PAUSE_PTS, local_pts);
     }
 
 exit:
     pthread_mutex_unlock(&avsync->lock);
+    release_frames(avsync, dropped, drop_cnt, AV_SYNC_FREE_DROPPED);
 
     /* underflow check */
     if (avsync->session_started && avsync->first_frame_toggled &&
@@ -835,8 +1350,8 @@ exit:
         if(diff_ms >= (avsync->underflow_cfg.time_thresh
                        + avsync->vsync_interval*avsync->last_holding_peroid/90)) {
             log_info ("[%d]underflow detected: %u", avsync->session_id, avsync->last_pts);
-            avsync->underflow_cb (avsync->last_pts,
-                    avsync->underflow_cb_priv);
+            event_dispatch_post(avsync->event_dispatch,
+                    SESSION_EVT_UNDERFLOW, avsync->last_pts);
             /* update time to control the underflow check call backs */
             avsync->frame_last_update_time = now;
         }
@@ -846,9 +1361,13 @@ exit:
         if (enter_last_frame != avsync->last_frame) {
             log_debug("[%d]pop %u", avsync->session_id, avsync->last_frame->pts);
             /* don't update vpts for out_lier */
-            if (avsync->last_frame->duration != -1)
-                msync_session_update_vpts(avsync->fd, systime,
+            if (avsync->last_frame->duration != -1) {
+                pthread_mutex_lock(&avsync->lock);
+                msync_fill_ts(&avsync->pending_vpts, systime,
                   avsync->last_frame->pts + avsync->extra_delay, interval * avsync->delay);
+                avsync->vpts_pending = true;
+                pthread_mutex_unlock(&avsync->lock);
+            }
         }
         log_trace("[%d]pop=%u, stc=%u, QNum=%d", avsync->session_id, avsync->last_frame->pts, systime, queue_size(avsync->frame_q));
     } else
@@ -861,11 +1380,138 @@ exit:
     return avsync->last_frame;
 }
 
+/* snapshot read is syscall free, ioctl only when it's not available */
+static int session_get_wall(struct av_sync_session *avsync,
+        uint32_t *wall, uint32_t *interval)
+{
+    if (avsync->wall_page &&
+            !msync_session_read_wall(avsync->wall_page, wall, interval))
+        return 0;
+    return msync_session_get_wall(avsync->fd, wall, interval);
+}
+
 static inline uint32_t abs_diff(uint32_t a, uint32_t b)
 {
     return (int)(a - b) > 0 ? a - b : b - a;
 }
 
+static void audio_clock_invalidate(struct av_sync_session *avsync)
+{
+    __atomic_store_n(&avsync->aclk_dirty, true, __ATOMIC_RELEASE);
+}
+
+static void audio_clock_anchor(struct av_sync_session *avsync,
+        pts90K wall, uint64_t now)
+{
+    float speed;
+    int32_t ppm;
+
+    if (wall == AV_SYNC_INVALID_PTS) {
+        avsync->aclk_valid = false;
+        return;
+    }
+    if (!avsync->aclk_valid) {
+        /* rate and deviation only change with events */
+        if (msync_session_get_rate(avsync->fd, &speed))
+            speed = avsync->speed;
+        if (msync_session_get_clock_dev(avsync->fd, &ppm))
+            ppm = 0;
+        avsync->aclk_rate = speed * 1000;
+        avsync->aclk_ppm = ppm;
+        avsync->aclk_stalled = avsync->paused;
+    } else {
+        /* wall not moving, e.g. paused by peer or waiting for start,
+         * ask the kernel again until it moves
+         */
+        avsync->aclk_stalled = (wall == avsync->aclk_wall);
+    }
+    avsync->aclk_wall = wall;
+    avsync->aclk_mono = now;
+    avsync->aclk_valid = true;
+}
+
+/* Wall clock for audio render decisions.
+ * Reads the shared snapshot when the driver provides one. Otherwise
+ * extrapolates the last kernel wall and only asks the kernel every
+ * aclk_cur_interval ms, after an event, and on every call while the
+ * wall stands still. The interval shrinks while the extrapolation is
+ * off by more than AUDIO_CLK_MAX_ERR.
+ */
+static void audio_clock_get(struct av_sync_session *avsync, pts90K *systime)
+{
+    struct timespec ts;
+    uint64_t now;
+    pts90K wall, est = AV_SYNC_INVALID_PTS;
+
+    if (avsync->wall_page &&
+            !msync_session_read_wall(avsync->wall_page, systime, NULL))
+        return;
+    if (!avsync->aclk_interval) {
+        msync_session_get_wall(avsync->fd, systime, NULL);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (__atomic_exchange_n(&avsync->aclk_dirty, false, __ATOMIC_ACQ_REL))
+        avsync->aclk_valid = false;
+
+    if (avsync->aclk_valid && !avsync->aclk_stalled) {
+        est = msync_wall_extrapolate(avsync->aclk_wall, avsync->aclk_mono,
+                now, avsync->aclk_rate, avsync->aclk_ppm);
+        if (now - avsync->aclk_mono <
+                avsync->aclk_cur_interval * 1000000ULL) {
+            *systime = est;
+            return;
+        }
+    }
+
+    msync_session_get_wall(avsync->fd, &wall, NULL);
+    if (est != AV_SYNC_INVALID_PTS && wall != AV_SYNC_INVALID_PTS) {
+        if (abs_diff(est, wall) > AUDIO_CLK_MAX_ERR) {
+            log_debug("[%d]aclk drift est %u wall %u interval %d",
+                    avsync->session_id, est, wall, avsync->aclk_cur_interval);
+            avsync->aclk_cur_interval /= 2;
+            if (avsync->aclk_cur_interval < AUDIO_CLK_MIN_INTERVAL_MS)
+                avsync->aclk_cur_interval = AUDIO_CLK_MIN_INTERVAL_MS;
+        } else if (avsync->aclk_cur_interval < avsync->aclk_interval) {
+            avsync->aclk_cur_interval *= 2;
+            if (avsync->aclk_cur_interval > avsync->aclk_interval)
+                avsync->aclk_cur_interval = avsync->aclk_interval;
+        }
+    }
+    audio_clock_anchor(avsync, wall, now);
+    *systime = wall;
+}
+
+/* Report apts to msync only when the driver needs a new anchor:
+ * forced by events, after min_interval of rendered audio, or when
+ * render delta moved by more than max_drift since the last report.
+ * Stream pts is the time base so no clock read is needed.
+ */
+static void audio_publish_apts(struct av_sync_session *avsync,
+        pts90K systime, pts90K pts)
+{
+    int delta = (int)(systime - pts);
+    int elapsed = (int)(pts - avsync->apts_pub_pts);
+
+    avsync->stats.apts_render_cnt++;
+    if (!avsync->apts_pub_force &&
+            elapsed >= 0 &&
+            elapsed < avsync->apts_policy.min_interval * 90 &&
+            abs(delta - avsync->apts_pub_delta) <= avsync->apts_policy.max_drift * 90)
+        return;
+
+    msync_session_update_apts(avsync->fd, systime, pts, 0);
+    avsync->stats.apts_publish_cnt++;
+    avsync->apts_pub_pts = pts;
+    avsync->apts_pub_delta = delta;
+    avsync->apts_pub_force = false;
+    /* driver re-bases wall beyond adjust threshold */
+    if (abs(delta) > DEFAULT_WALL_ADJ_THRES)
+        audio_clock_invalidate(avsync);
+}
+
 static uint64_t time_diff (struct timespec *b, struct timespec *a)
 {
     return (uint64_t)(b->tv_sec - a->tv_sec)*1000000 + (b->tv_nsec/1000 - a->tv_nsec/1000);
@@ -1136,27 +1782,116 @@ int av_sync_change_mode(void *sync, enum sync_mode mode)
 
 int av_sync_change_mode_by_id(int id, enum sync_mode mode)
 {
-    int fd;
-    char dev_name[20];
+    struct av_sync_session *avsync;
+    int fd, rc;
 
-    snprintf(dev_name, sizeof(dev_name), "/dev/%s%d", SESSION_DEV, id);
-    fd = open(dev_name, O_RDONLY | O_CLOEXEC);
-    if (fd < 0) {
-        log_error("open %s errno %d", dev_name, errno);
-        return -1;
+    pthread_mutex_lock(&glock);
+    avsync = registry_find(id);
+    if (avsync) {
+        rc = msync_session_set_mode(avsync->fd, mode);
+        pthread_mutex_unlock(&glock);
+    } else {
+        pthread_mutex_unlock(&glock);
+        fd = session_open_tmp(id);
+        if (fd < 0)
+            return -1;
+        rc = msync_session_set_mode(fd, mode);
+        msync_session_close(fd);
     }
-
-    if (msync_session_set_mode(fd, mode)) {
+    if (rc) {
         log_error("[%d]fail to set mode %d", id, mode);
-        close(fd);
         return -1;
     }
-
-    close(fd);
     log_info("session[%d] set mode %d", id, mode);
     return 0;
 }
 
+int av_sync_get_mode_by_id(int id, enum sync_mode *mode)
+{
+    struct av_sync_session *avsync;
+    int fd, rc;
+
+    if (!mode)
+        return -1;
+    pthread_mutex_lock(&glock);
+    avsync = registry_find(id);
+    if (avsync) {
+        rc = msync_session_get_mode(avsync->fd, mode);
+        pthread_mutex_unlock(&glock);
+        return rc;
+    }
+    pthread_mutex_unlock(&glock);
+
+    fd = session_open_tmp(id);
+    if (fd < 0)
+        return -1;
+    rc = msync_session_get_mode(fd, mode);
+    msync_session_close(fd);
+    return rc;
+}
+
+int av_sync_get_clock_by_id(int id, pts90K *pts)
+{
+    struct av_sync_session *avsync;
+    int fd, rc;
+
+    if (!pts)
+        return -1;
+    pthread_mutex_lock(&glock);
+    avsync = registry_find(id);
+    if (avsync) {
+        /* wall snapshot when mapped, no ioctl */
+        rc = session_get_wall(avsync, pts, NULL);
+        pthread_mutex_unlock(&glock);
+        return rc;
+    }
+    pthread_mutex_unlock(&glock);
+
+    fd = session_open_tmp(id);
+    if (fd < 0)
+        return -1;
+    rc = msync_session_get_wall(fd, pts, NULL);
+    msync_session_close(fd);
+    return rc;
+}
+
+int av_sync_get_pos_by_id(int id, enum sync_type type,
+        pts90K *pts, uint64_t *mono_clock)
+{
+    struct av_sync_session *avsync;
+    bool is_video = type == AV_SYNC_TYPE_VIDEO;
+    int fd, rc;
+
+    if (!pts)
+        return -1;
+    if (type != AV_SYNC_TYPE_AUDIO && type != AV_SYNC_TYPE_VIDEO)
+        return -2;
+    pthread_mutex_lock(&glock);
+    avsync = registry_find(id);
+    if (avsync) {
+        struct av_sync_session *v;
+
+        for (v = registry; is_video && v; v = v->reg_next) {
+            if (v->session_id != id || v->type != AV_SYNC_TYPE_VIDEO)
+                continue;
+            pthread_mutex_lock(&v->lock);
+            video_flush_vpts(v);
+            pthread_mutex_unlock(&v->lock);
+        }
+        rc = msync_session_get_pts(avsync->fd, pts, mono_clock, is_video);
+        pthread_mutex_unlock(&glock);
+        return rc;
+    }
+    pthread_mutex_unlock(&glock);
+
+    fd = session_open_tmp(id);
+    if (fd < 0)
+        return -1;
+    rc = msync_session_get_pts(fd, pts, mono_clock, is_video);
+    msync_session_close(fd);
+    return rc;
+}
+
 int av_sync_get_mode(void *sync, enum sync_mode *mode)
 {
     struct av_sync_session *avsync = (struct av_sync_session *)sync;
@@ -1189,6 +1924,9 @@ int av_sync_set_pause_pts_cb(void *sync, pause_pts_done cb, void *priv)
 
     avsync->pause_pts_cb = cb;
     avsync->pause_cb_priv = priv;
+    /* only video handles dispatch events */
+    if (cb && !avsync->event_fd_mode && avsync->event_dispatch)
+        return event_dispatch_start_worker(avsync->event_dispatch);
     return 0;
 }
 
@@ -1210,8 +1948,104 @@ int av_sync_set_underflow_check_cb(void *sync, underflow_detected cb, void *priv
     log_info("[%d] av_sync_set_underflow_check_cb %p priv %p time %d",
              avsync->session_id, avsync->underflow_cb, avsync->underflow_cb_priv,
              avsync->underflow_cfg.time_thresh);
+    /* only video handles dispatch events */
+    if (cb && !avsync->event_fd_mode && avsync->event_dispatch)
+        return event_dispatch_start_worker(avsync->event_dispatch);
+    return 0;
+}
+
+int av_sync_get_event_fd(void *sync)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync || !avsync->event_dispatch)
+      return -1;
+
+    avsync->event_fd_mode = true;
+    return event_dispatch_get_fd(avsync->event_dispatch);
+}
+
+int av_sync_dispatch_events(void *sync)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync || !avsync->event_dispatch)
+      return -1;
+
+    return event_dispatch_drain(avsync->event_dispatch);
+}
+
+/* runs on event worker or av_sync_dispatch_events caller */
+static void session_event(void *priv, int type, uint32_t pts)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)priv;
+
+    switch (type) {
+    case SESSION_EVT_PAUSE_PTS:
+        if (avsync->pause_pts_cb)
+            avsync->pause_pts_cb(pts, avsync->pause_cb_priv);
+        log_info ("[%d] reach pause pts: %u handle done",
+            avsync->session_id, pts);
+        break;
+    case SESSION_EVT_UNDERFLOW:
+        if (avsync->underflow_cb)
+            avsync->underflow_cb(pts, avsync->underflow_cb_priv);
+        break;
+    default:
+        log_error("[%d]unknown event %d", avsync->session_id, type);
+        break;
+    }
+}
+
+int av_sync_set_free_frames_cb(void *sync, free_frames_cb cb, void *priv)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync)
+      return -1;
+
+    avsync->free_frames = cb;
+    avsync->free_frames_priv = priv;
+    log_info("[%d]free frames cb %p priv %p", avsync->session_id, cb, priv);
+    return 0;
+}
+
+int av_sync_set_apts_publish_policy(void *sync, struct apts_publish_policy *policy)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync)
+        return -1;
+
+    if (policy) {
+        if (policy->min_interval < 0 || policy->max_drift < 0)
+            return -1;
+        avsync->apts_policy = *policy;
+    } else {
+        avsync->apts_policy.min_interval = APTS_PUBLISH_INTERVAL_MS;
+        avsync->apts_policy.max_drift = APTS_PUBLISH_DRIFT_MS;
+    }
+    avsync->apts_pub_force = true;
+
+    log_info("[%d]apts publish interval %d ms drift %d ms",
+             avsync->session_id, avsync->apts_policy.min_interval,
+             avsync->apts_policy.max_drift);
+    return 0;
+}
+
+int av_sync_get_stats(void *sync, struct av_sync_stats *stats)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync || !stats)
+        return -1;
+
+    *stats = avsync->stats;
+    event_dispatch_get_stats(avsync->event_dispatch, &stats->cb_cnt,
+            &stats->cb_total_ns, &stats->cb_max_ns, &stats->cb_lost);
     return 0;
 }
+
 static void trigger_audio_start_cb(struct av_sync_session *avsync,
         avs_ascb_reason reason)
 {
@@ -1257,7 +2091,8 @@ avs_start_ret av_sync_audio_start(
     uint32_t start_mode;
     uint32_t systime = 0;
     avs_start_ret ret = AV_SYNC_ASTART_ERR;
-    bool create_poll_t = false;
+    bool watch_session = false;
+    struct session_state st;
 
     if (!avsync)
         return ret;
@@ -1266,7 +2101,7 @@ avs_start_ret av_sync_audio_start(
              avsync->session_id, (int)pts/90, (int)delay/90);
 
     if (avsync->in_audio_switch) {
-        msync_session_get_wall(avsync->fd, &systime, NULL);
+        session_get_wall(avsync, &systime, NULL);
         if (systime == AV_SYNC_INVALID_PTS) {
                 log_info("%d Invalid systime could be paused pts %d ms switch_state %d again",
                 avsync->session_id, (int) pts/90, avsync->audio_switch_state);
@@ -1343,7 +2178,7 @@ avs_start_ret av_sync_audio_start(
 
     if (avsync->mode == AV_SYNC_MODE_AMASTER ||
             avsync->in_audio_switch || LIVE_MODE(avsync->mode))
-        create_poll_t = true;
+        watch_session = true;
 
     if (start_mode == AVS_START_ASYNC) {
         if (!cb) {
@@ -1354,19 +2189,18 @@ avs_start_ret av_sync_audio_start(
         avsync->audio_start_priv = priv;
     }
 
-    if (create_poll_t && !avsync->poll_thread) {
-        int ret;
-
-        log_info("[%d]start poll thread", avsync->session_id);
-        avsync->quit_poll = false;
-        ret = pthread_create(&avsync->poll_thread, NULL, poll_thread, avsync);
-        if (ret) {
-            log_error("[%d]create poll thread errno %d", avsync->session_id, errno);
+    if (watch_session && !avsync->in_reactor) {
+        log_info("[%d]watch session", avsync->session_id);
+        if (reactor_add(avsync->fd, session_notify, avsync)) {
+            log_error("[%d]watch session fail", avsync->session_id);
             return AV_SYNC_ASTART_ERR;
         }
+        avsync->in_reactor = true;
+        /* changes before this were not watched */
+        session_state_fetch(avsync, false, SRC_A, &st);
     }
     if (LIVE_MODE(avsync->mode)) {
-        msync_session_get_wall(avsync->fd, &systime, NULL);
+        session_get_wall(avsync, &systime, NULL);
         log_info("[%d]return %u w %u pts %u d %u",
                 avsync->session_id, ret, systime, pts, delay);
     }
@@ -1390,7 +2224,7 @@ int av_sync_audio_render(
     if (!avsync || !policy)
         return -1;
 
-    msync_session_get_wall(avsync->fd, &systime, NULL);
+    audio_clock_get(avsync, &systime);
     avsync->last_pts = pts;
 
     log_trace("audio render pts %u, systime %u, mode %u diff ms %d",
@@ -1488,11 +2322,12 @@ done:
             avsync->apts = pts;
         if (!avsync->in_audio_switch) {
             if (!out_lier)
-                msync_session_update_apts(avsync->fd, systime, pts, 0);
+                audio_publish_apts(avsync, systime, pts);
             log_debug("[%d]return %d sys %u - pts %u = %d",
                     avsync->session_id, action, systime, pts, systime - pts);
         } else if(avsync->audio_switch_state == AUDIO_SWITCH_STAT_FINISH) {
-            msync_session_update_apts(avsync->fd, systime, pts, 0);
+            avsync->apts_pub_force = true;
+            audio_publish_apts(avsync, systime, pts);
             log_info("[%d] audio switch done sys %u pts %u",
                 avsync->session_id, systime, pts);
             msync_session_set_audio_switch(avsync->fd, false);
@@ -1510,6 +2345,8 @@ done:
             log_info ("[%d]audio disc %u --> %u",
                     avsync->session_id, systime, pts);
             msync_session_set_audio_dis(avsync->fd, pts);
+            audio_clock_invalidate(avsync);
+            avsync->apts_pub_force = true;
             avsync->last_disc_pts = pts;
         } else if (action == AV_SYNC_AA_DROP) {
             struct timespec now;
@@ -1524,6 +2361,8 @@ done:
                 log_info ("[%d]audio keep dropping sys %u vs a %u",
                         avsync->session_id, systime, pts);
                 msync_session_set_audio_dis(avsync->fd, pts);
+                audio_clock_invalidate(avsync);
+                avsync->apts_pub_force = true;
             }
         }
         if (action != AV_SYNC_AA_DROP)
@@ -1545,6 +2384,11 @@ int av_sync_get_pos(void *sync, pts90K *pts, uint64_t *mono_clock)
     if (avsync->type != AV_SYNC_TYPE_AUDIO &&
         avsync->type != AV_SYNC_TYPE_VIDEO)
         return -2;
+    if (avsync->type == AV_SYNC_TYPE_VIDEO) {
+        pthread_mutex_lock(&avsync->lock);
+        video_flush_vpts(avsync);
+        pthread_mutex_unlock(&avsync->lock);
+    }
     return msync_session_get_pts(avsync->fd, pts,
         mono_clock, avsync->type == AV_SYNC_TYPE_VIDEO);
 }
@@ -1555,7 +2399,7 @@ int av_sync_get_clock(void *sync, pts90K *pts)
 
     if (!avsync || !pts)
         return -1;
-    return msync_session_get_wall(avsync->fd, pts, NULL);
+    return session_get_wall(avsync, pts, NULL);
 }
 
 static void handle_mode_change_a(struct av_sync_session* avsync,
@@ -1655,127 +2499,182 @@ static void handle_mode_change_v(struct av_sync_session* avsync,
     }
 }
 
-static void * poll_thread(void * arg)
+/* reactor callback, mode change. Non-exclusive wait so all the
+ * processes shall be woken up
+ */
+static void session_notify(void *priv, uint32_t events)
 {
-    int ret = 0;
-    struct av_sync_session *avsync = (struct av_sync_session *)arg;
-    const int fd = avsync->fd;
-    int poll_timeout = 10;
-    struct pollfd pfd = {
-      /* default blocking capture */
-      .events =  POLLPRI,
-      .fd = avsync->fd,
-    };
-    enum src_flag sflag = SRC_A;
-
-    log_info("[%d]enter", avsync->session_id);
+    struct av_sync_session *avsync = (struct av_sync_session *)priv;
+    struct session_state st;
+    enum src_flag sflag;
 
-    if (avsync->type == AV_SYNC_TYPE_AUDIO) {
-        prctl (PR_SET_NAME, "avs_apoll");
-        sflag = SRC_A;
-    } else if (avsync->type == AV_SYNC_TYPE_VIDEO) {
-        prctl (PR_SET_NAME, "avs_vpoll");
-        sflag = SRC_V;
-        poll_timeout = 100;
-    }
-
-    while (!avsync->quit_poll) {
-        for (;;) {
-          ret = poll(&pfd, 1, poll_timeout);
-          if (ret > 0)
-              break;
-          if (avsync->quit_poll)
-              goto exit;
-          if (errno == EINTR) {
-              log_debug("[%d] poll interrupted", avsync->session_id);
-              continue;
-          }
-          if (errno == EAGAIN || errno == ENOMEM) {
-              log_info("[%d] poll error %d", avsync->session_id, errno);
-              continue;
-          }
-        }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        log_warn("[%d] session fd error %x", avsync->session_id, events);
+        return;
+    }
 
-        /* error handling */
-        if (pfd.revents & POLLERR) {
-            usleep(poll_timeout * 1000);
-            continue;
-        }
+    sflag = avsync->type == AV_SYNC_TYPE_VIDEO ? SRC_V : SRC_A;
+    if (session_state_fetch(avsync, true, sflag, &st))
+        return;
+    audio_clock_invalidate(avsync);
 
-        if (pfd.revents & POLLNVAL) {
-            log_warn("[%d] fd closed", avsync->session_id);
-            goto exit;
-        }
-        /* mode change. Non-exclusive wait so all the processes
-         * shall be woken up
-         */
-        if (pfd.revents & POLLPRI) {
-            bool v_active, a_active, v_timeout;
-            enum internal_sync_stat stat;
-
-            msync_session_get_stat(fd, true, &avsync->active_mode, &stat,
-                &v_active, &a_active, &v_timeout, &avsync->in_audio_switch, sflag);
-
-            if (avsync->type == AV_SYNC_TYPE_AUDIO)
-                handle_mode_change_a(avsync, stat, v_active, a_active, v_timeout);
-            else if (avsync->type == AV_SYNC_TYPE_VIDEO)
-                handle_mode_change_v(avsync, stat, v_active, a_active, v_timeout);
-            usleep(10000);
-        } else {
-            log_debug("[%d] unexpected revents %x", avsync->session_id, pfd.revents);
-            usleep(poll_timeout * 1000);
-        }
-    }
-exit:
-    log_info("[%d]quit", avsync->session_id);
-    return NULL;
+    if (avsync->type == AV_SYNC_TYPE_AUDIO)
+        handle_mode_change_a(avsync, st.stat,
+                st.v_active, st.a_active, st.v_timeout);
+    else if (avsync->type == AV_SYNC_TYPE_VIDEO)
+        handle_mode_change_v(avsync, st.stat,
+                st.v_active, st.a_active, st.v_timeout);
+}
+
+/* gen:32 | reserved:12 | switch:1 v_timeout:1 a_active:1 v_active:1 |
+ * stat:8 | mode:8, one word so readers never see a torn state.
+ * gen 0 means nothing mirrored yet.
+ */
+static uint64_t state_pack(const struct session_state *st, uint32_t gen)
+{
+    return (uint64_t)gen << 32 |
+        (uint64_t)st->audio_switch << 19 | (uint64_t)st->v_timeout << 18 |
+        (uint64_t)st->a_active << 17 | (uint64_t)st->v_active << 16 |
+        (uint64_t)(st->stat & 0xff) << 8 | (st->active_mode & 0xff);
 }
 
-#define DEMOD_NODE "/sys/class/dtvdemod/atsc_para"
-/* return ppm between demod and PCR clock */
-int32_t static dmod_get_sfo_dev(struct av_sync_session *avsync)
+static void state_unpack(uint64_t w, struct session_state *st)
 {
-    int fd = -1, ppm = 0, nread;
-    char buf[128];
-    uint32_t reg_v, lock;
-    float val;
+    st->active_mode = (enum sync_mode)(w & 0xff);
+    st->stat = (enum internal_sync_stat)((w >> 8) & 0xff);
+    st->v_active = (w >> 16) & 1;
+    st->a_active = (w >> 17) & 1;
+    st->v_timeout = (w >> 18) & 1;
+    st->audio_switch = (w >> 19) & 1;
+}
 
-    fd = open(DEMOD_NODE, O_RDWR);
-    if (fd < 0) {
-        log_warn("node not found %s", DEMOD_NODE);
-        /* do not retry */
-        avsync->ppm_adjusted = true;
+static void session_state_store(struct av_sync_session *avsync,
+        const struct session_state *st)
+{
+    uint64_t old, new;
+    uint32_t gen;
+
+    old = __atomic_load_n(&avsync->state_mirror, __ATOMIC_RELAXED);
+    do {
+        gen = (uint32_t)(old >> 32) + 1;
+        if (!gen)
+            gen = 1;
+        new = state_pack(st, gen);
+    } while (!__atomic_compare_exchange_n(&avsync->state_mirror, &old, new,
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    avsync->active_mode = st->active_mode;
+    avsync->in_audio_switch = st->audio_switch;
+}
+
+/* ask the driver and update the mirror */
+static int session_state_fetch(struct av_sync_session *avsync,
+        bool clean_poll, enum src_flag flag, struct session_state *st)
+{
+    uint64_t w = __atomic_load_n(&avsync->state_mirror, __ATOMIC_ACQUIRE);
+    int rc;
+
+    memset(st, 0, sizeof(*st));
+    /* driver leaves unknown modes untouched */
+    st->active_mode = (w >> 32) ? (enum sync_mode)(w & 0xff) :
+        avsync->active_mode;
+    rc = msync_session_get_stat(avsync->fd, clean_poll, &st->active_mode,
+            &st->stat, &st->v_active, &st->a_active, &st->v_timeout,
+            &st->audio_switch, flag);
+    if (rc)
+        return rc;
+    session_state_store(avsync, st);
+    return 0;
+}
+
+/* Served from the mirror while the reactor keeps it up to date,
+ * every state change of the driver comes with a notification.
+ * Audio handles join the reactor only to watch the session, see
+ * av_sync_audio_start, the others ask the driver each time.
+ */
+static int session_state_get(struct av_sync_session *avsync,
+        bool refresh, struct session_state *st)
+{
+    uint64_t w = __atomic_load_n(&avsync->state_mirror, __ATOMIC_ACQUIRE);
+
+    /* also bumped from the reactor thread */
+    __atomic_add_fetch(&avsync->stats.state_query_cnt, 1, __ATOMIC_RELAXED);
+    if (!refresh && avsync->in_reactor && (w >> 32)) {
+        state_unpack(w, st);
+        avsync->active_mode = st->active_mode;
+        avsync->in_audio_switch = st->audio_switch;
         return 0;
     }
-    snprintf(buf, sizeof(buf), "%d", 5);
-    write(fd, buf, 2);
+    __atomic_add_fetch(&avsync->stats.state_ioctl_cnt, 1, __ATOMIC_RELAXED);
+    return session_state_fetch(avsync, false, SRC_A, st);
+}
 
-    lseek(fd, 0, SEEK_SET);
+int av_sync_refresh_state(void *sync, uint32_t *gen)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+    struct session_state st;
 
-    nread = read(fd, buf, sizeof(buf)-1);
-    if (nread <= 0) {
-        log_error("read error");
-        goto err;
+    if (!avsync)
+        return -1;
+    if (session_state_get(avsync, true, &st)) {
+        log_error("[%d] can not get session state", avsync->session_id);
+        return -1;
     }
-    buf[nread] = 0;
-    if (sscanf(buf, "ck=0x%x lock=%d", &reg_v, &lock) != 2) {
-        log_error("wrong format %s", buf);
-        goto err;
+    if (gen)
+        *gen = (uint32_t)(__atomic_load_n(&avsync->state_mirror,
+                    __ATOMIC_ACQUIRE) >> 32);
+    return 0;
+}
+
+int av_sync_get_state_gen(void *sync, uint32_t *gen)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync || !gen)
+        return -1;
+    *gen = (uint32_t)(__atomic_load_n(&avsync->state_mirror,
+                __ATOMIC_ACQUIRE) >> 32);
+    return 0;
+}
+
+#define SFO_BACKOFF_MIN_MS 100
+#define SFO_BACKOFF_MAX_MS 2000
+/* initial estimation from demod SFO HW, rate limited.
+ * Return ppm between demod and PCR clock, 0 if not sampled
+ */
+static int32_t sfo_sample(struct av_sync_session *avsync)
+{
+    struct timespec now;
+    uint64_t now_ms;
+    int32_t ppm = 0;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    now_ms = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+    if (now_ms < avsync->sfo_next_ms)
+        return 0;
+
+    avsync->sfo_reads++;
+    rc = msync_demod_get_sfo(&ppm);
+    if (rc == -2) {
+        /* no demod, do not retry */
+        avsync->sfo_done = true;
+        return 0;
     }
-    if (lock != 0x1f) {
-        log_info("demod not locked");
-        goto err;
+    if (rc) {
+        /* not locked yet, PCR keeps coming meanwhile */
+        if (!avsync->sfo_backoff_ms)
+            avsync->sfo_backoff_ms = SFO_BACKOFF_MIN_MS;
+        else if (avsync->sfo_backoff_ms < SFO_BACKOFF_MAX_MS)
+            avsync->sfo_backoff_ms *= 2;
+        if (avsync->sfo_backoff_ms > SFO_BACKOFF_MAX_MS)
+            avsync->sfo_backoff_ms = SFO_BACKOFF_MAX_MS;
+        avsync->sfo_next_ms = now_ms + avsync->sfo_backoff_ms;
+        return 0;
     }
-    if (reg_v > ((2 << 20) - 1))
-        reg_v -= (2 << 21);
-    val = reg_v * 10.762238f / 12 * 1000000 / (2 << 25);
-    ppm = val;
-    log_info("ppm from SFO %d", ppm);
-    avsync->ppm_adjusted = true;
-
-err:
-    if (fd >= 0)
-      close(fd);
+    log_info("[%d]ppm from SFO %d after %u reads",
+            avsync->session_id, ppm, avsync->sfo_reads);
+    avsync->sfo_done = true;
     return ppm;
 }
 
@@ -1791,30 +2690,52 @@ int av_sync_set_pcr_clock(void *sync, pts90K pts, uint64_t mono_clock)
     if (avsync->type != AV_SYNC_TYPE_PCR)
         return -2;
 
-    /* initial estimation from Demod SFO HW */
-    if (!avsync->ppm_adjusted) {
-      ppm = dmod_get_sfo_dev(avsync);
-      if (ppm != 0) {
-          /* ppm > 0 means board clock is faster */
-          msync_session_set_clock_dev(avsync->fd, -ppm);
-      }
+    /* value this source converged to last time, refined below */
+    if (avsync->clock_key && !avsync->ppm_cache_checked) {
+        avsync->ppm_cache_checked = true;
+        if (!ppm_cache_get(avsync->clock_key, &avsync->ppm_cached) &&
+                avsync->ppm_cached &&
+                !msync_session_set_clock_dev(avsync->fd, avsync->ppm_cached)) {
+            log_info("[%d]ppm:%d from cache", avsync->session_id,
+                    avsync->ppm_cached);
+            avsync->ppm = avsync->ppm_cached;
+            avsync->ppm_adjusted = true;
+        }
+    }
+    /* SFO hint until the monitor has its own estimation */
+    if (!avsync->ppm_adjusted && !avsync->sfo_done) {
+        ppm = sfo_sample(avsync);
+        /* ppm > 0 means board clock is faster */
+        if (ppm != 0 && !msync_session_set_clock_dev(avsync->fd, -ppm)) {
+            /* monitor only overrides when it disagrees */
+            avsync->ppm = -ppm;
+            avsync->ppm_adjusted = true;
+        }
     }
     pcr.monoclk = mono_clock / 1000;
-    pcr.pts = (long long) pts * 1000 / 90;
+    pcr.pts = pcr_pts_to_us(pts);
     pcr_monitor_process(avsync->pcr_monitor, &pcr);
 
     status = pcr_monitor_get_status(avsync->pcr_monitor);
 
     if (status >= DEVIATION_READY) {
         pcr_monitor_get_deviation(avsync->pcr_monitor, &ppm);
+        /* estimators may refine it progressively, push every change */
         if (avsync->ppm != ppm) {
+            int ci = -1;
+
+            pcr_monitor_get_confidence(avsync->pcr_monitor, &ci);
             avsync->ppm = ppm;
-            log_info("[%d]ppm:%d", avsync->session_id, ppm);
+            log_info("[%d]ppm:%d +/- %d", avsync->session_id, ppm, ci);
             if (msync_session_set_clock_dev(avsync->fd, ppm))
                 log_error("set clock dev fail");
             else
                 avsync->ppm_adjusted = true;
         }
+        if (avsync->clock_key && status == DEVIATION_LONG_TERM_READY &&
+                ppm != avsync->ppm_cached &&
+                !ppm_cache_put(avsync->clock_key, ppm))
+            avsync->ppm_cached = ppm;
     }
 
     return msync_session_set_pcr(avsync->fd, pts, mono_clock);
@@ -1843,26 +2764,27 @@ int av_sync_set_session_name(void *sync, const char *name)
 int av_sync_set_audio_switch(void *sync,  bool start)
 {
     struct av_sync_session *avsync = (struct av_sync_session *)sync;
-    bool v_active, a_active, v_timeout;
+    struct session_state st;
 
     if (!avsync)
         return -1;
-    if (msync_session_get_stat(avsync->fd, false, &avsync->active_mode, NULL,
-                &v_active, &a_active,
-                &v_timeout, &avsync->in_audio_switch, SRC_A)) {
+    if (session_state_get(avsync, false, &st)) {
         log_error("[%d] can not get session state",
                 avsync->session_id);
         return -1;
     }
-    if (!v_active || !a_active) {
+    if (!st.v_active || !st.a_active) {
         log_error("[%d]  no apply if not AV both active v %d a %d",
-            avsync->session_id, v_active, a_active);
+            avsync->session_id, st.v_active, st.a_active);
         return -1;
     }
     if (msync_session_set_audio_switch(avsync->fd, start)) {
         log_error("[%d]fail to set audio switch %d", avsync->session_id, start);
         return -1;
     }
+    /* do not wait for the notification to reflect our own change */
+    st.audio_switch = start;
+    session_state_store(avsync, &st);
     avsync->in_audio_switch = start;
     avsync->audio_switch_state = AUDIO_SWITCH_STAT_INIT;
     log_info("[%d]update audio switch to %d", avsync->session_id, start);
@@ -1872,11 +2794,11 @@ int av_sync_set_audio_switch(void *sync,  bool start)
 int av_sync_get_audio_switch(void *sync,  bool *start)
 {
     struct av_sync_session *avsync = (struct av_sync_session *)sync;
+    struct session_state st;
 
     if (!avsync)
         return -1;
-    if (msync_session_get_stat(avsync->fd, false, &avsync->active_mode, NULL,
-                NULL, NULL, NULL, &avsync->in_audio_switch, SRC_A)) {
+    if (session_state_get(avsync, false, &st)) {
         log_error("[%d] can not audio seamless switch state",
                 avsync->session_id);
         return -1;
@@ -1885,6 +2807,35 @@ int av_sync_get_audio_switch(void *sync,  bool *start)
     return 0;
 }
 
+int av_sync_set_clock_key(void *sync, uint64_t key)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync)
+        return -1;
+    if (avsync->type != AV_SYNC_TYPE_PCR)
+        return -2;
+    avsync->clock_key = key;
+    avsync->ppm_cache_checked = false;
+    avsync->ppm_cached = 0;
+    return 0;
+}
+
+int av_sync_get_clock_confidence(void *sync, int32_t *ci_ppm)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+    int ci;
+
+    if (!avsync || !ci_ppm)
+        return -1;
+    if (avsync->type != AV_SYNC_TYPE_PCR)
+        return -2;
+    if (pcr_monitor_get_confidence(avsync->pcr_monitor, &ci))
+        return -1;
+    *ci_ppm = ci;
+    return 0;
+}
+
 enum  clock_recovery_stat av_sync_get_clock_deviation(void *sync, int32_t *ppm)
 {
     struct av_sync_session *avsync = (struct av_sync_session *)sync;
@@ -1903,23 +2854,16 @@ enum  clock_recovery_stat av_sync_get_clock_deviation(void *sync, int32_t *ppm)
         return CLK_RECOVERY_READY;
 }
 
-static int video_mono_push_frame(struct av_sync_session *avsync, struct vframe *frame)
+static int video_mono_push_frame(struct av_sync_session *avsync,
+        struct vframe **frames, int n)
 {
     int ret;
 
-    if (!avsync->frame_q) {
-        avsync->frame_q = create_q(MAX_FRAME_NUM);
-        if (!avsync->frame_q) {
-            log_error("[%d]create queue fail", avsync->session_id);
-
-            return -1;
-        }
-    }
-
-    ret = queue_item(avsync->frame_q, frame);
+    ret = queue_items(avsync->frame_q, (void **)frames, n);
+    update_q_watermark(avsync);
     if (ret)
         log_error("queue fail:%d", ret);
-    log_debug("[%d]push %llu, QNum=%d", avsync->session_id, frame->mts, queue_size(avsync->frame_q));
+    log_debug("[%d]push %llu, QNum=%d", avsync->session_id, frames[n - 1]->mts, queue_size(avsync->frame_q));
     return ret;
 }
 
@@ -1938,6 +2882,8 @@ static struct vframe * video_mono_pop_frame(struct av_sync_session *avsync)
     struct vframe *frame = NULL, *enter_last_frame = NULL;
     uint64_t systime;
     int toggle_cnt = 0;
+    struct vframe *dropped[MAX_FRAME_Q_DEPTH];
+    int drop_cnt = 0;
 
     enter_last_frame = avsync->last_frame;
     systime = avsync->msys;
@@ -1956,7 +2902,12 @@ static struct vframe * video_mono_pop_frame(struct av_sync_session *avsync)
                 if (toggle_cnt > 1) {
                     log_debug("[%d]free %llu cur %llu system %llu", avsync->session_id,
                              avsync->last_frame->mts, frame->mts, systime);
-                    avsync->last_frame->free(avsync->last_frame);
+                    if (drop_cnt == MAX_FRAME_Q_DEPTH) {
+                        release_frames(avsync, dropped, drop_cnt,
+                                AV_SYNC_FREE_DROPPED);
+                        drop_cnt = 0;
+                    }
+                    dropped[drop_cnt++] = avsync->last_frame;
                 }
             } else {
                 avsync->first_frame_toggled = true;
@@ -1966,6 +2917,7 @@ static struct vframe * video_mono_pop_frame(struct av_sync_session *avsync)
         } else
             break;
     }
+    release_frames(avsync, dropped, drop_cnt, AV_SYNC_FREE_DROPPED);
 
     if (avsync->last_frame) {
         if (enter_last_frame != avsync->last_frame)
@@ -2009,3 +2961,17 @@ int avs_sync_set_eos(void *sync)
 
     return 0;
 }
+
+int av_sync_set_audio_clock_interval(void *sync, int interval_ms)
+{
+    struct av_sync_session *avsync = (struct av_sync_session *)sync;
+
+    if (!avsync || interval_ms < 0)
+        return -1;
+
+    avsync->aclk_interval = interval_ms;
+    avsync->aclk_cur_interval = interval_ms;
+    audio_clock_invalidate(avsync);
+    log_info("[%d]audio clock interval %d ms", avsync->session_id, interval_ms);
+    return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: deferred client callbacks of one session
+ */
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include "aml_avsync_log.h"
+#include "event_dispatch.h"
+
+/* pause pts and underflow are rate limited by VSYNC, 16 is plenty */
+#define EVENT_RING_SIZE 16
+
+struct session_event {
+    int type;
+    uint32_t pts;
+};
+
+struct event_dispatch {
+    struct session_event ring[EVENT_RING_SIZE];
+    atomic_uint ri;
+    atomic_uint wi;
+    int efd;
+
+    event_handler handler;
+    void *priv;
+
+    /* one consumer at a time: worker, drain() or destroy() */
+    pthread_mutex_t drain_lock;
+    /* start and stop of the worker, never taken by the worker itself
+     * so it can be held across the join
+     */
+    pthread_mutex_t worker_lock;
+    pthread_t worker;
+    bool worker_running;
+    /* bumped to stop the current worker, which runs while it matches
+     * start_gen as read when it started
+     */
+    atomic_uint gen;
+    uint32_t start_gen;
+    /* destroyed from a callback, the detached worker frees it */
+    bool worker_frees;
+
+    /* stats, written by consumer */
+    uint64_t cb_cnt;
+    uint64_t cb_total_ns;
+    uint64_t cb_max_ns;
+    atomic_ullong lost;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void* event_dispatch_create(event_handler handler, void *priv)
+{
+    struct event_dispatch *d;
+
+    d = (struct event_dispatch *)calloc(1, sizeof(*d));
+    if (!d) {
+        log_error("OOM");
+        return NULL;
+    }
+    d->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (d->efd < 0) {
+        log_error("eventfd errno %d", errno);
+        free(d);
+        return NULL;
+    }
+    d->handler = handler;
+    d->priv = priv;
+    atomic_init(&d->ri, 0);
+    atomic_init(&d->wi, 0);
+    atomic_init(&d->gen, 0);
+    atomic_init(&d->lost, 0);
+    pthread_mutex_init(&d->drain_lock, NULL);
+    pthread_mutex_init(&d->worker_lock, NULL);
+    return d;
+}
+
+static void wake(struct event_dispatch *d)
+{
+    uint64_t one = 1;
+
+    if (write(d->efd, &one, sizeof(one)) != sizeof(one))
+        log_error("wake errno %d", errno);
+}
+
+int event_dispatch_post(void *handle, int type, uint32_t pts)
+{
+    struct event_dispatch *d = handle;
+    uint32_t wi, ri;
+
+    if (!d)
+        return -1;
+    wi = atomic_load_explicit(&d->wi, memory_order_relaxed);
+    ri = atomic_load_explicit(&d->ri, memory_order_acquire);
+    if (wi - ri >= EVENT_RING_SIZE) {
+        atomic_fetch_add(&d->lost, 1);
+        log_error("event %d pts %u lost", type, pts);
+        return -1;
+    }
+    d->ring[wi % EVENT_RING_SIZE].type = type;
+    d->ring[wi % EVENT_RING_SIZE].pts = pts;
+    atomic_store_explicit(&d->wi, wi + 1, memory_order_release);
+    wake(d);
+    return 0;
+}
+
+/* A worker, with its @gen, stops right after the callback that stopped
+ * it, the handle may be gone
+ */
+static int drain_locked(struct event_dispatch *d, const uint32_t *gen)
+{
+    uint32_t ri, wi;
+    uint64_t cnt, start, cost;
+    int n = 0;
+
+    /* clear before reading ring, posts after this wake us again.
+     * EAGAIN is a drain() with no wake up pending
+     */
+    if (read(d->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        log_error("clear errno %d", errno);
+    ri = atomic_load_explicit(&d->ri, memory_order_relaxed);
+    wi = atomic_load_explicit(&d->wi, memory_order_acquire);
+    while (ri != wi) {
+        struct session_event evt = d->ring[ri % EVENT_RING_SIZE];
+
+        atomic_store_explicit(&d->ri, ++ri, memory_order_release);
+        start = now_ns();
+        d->handler(d->priv, evt.type, evt.pts);
+        if (gen && atomic_load(&d->gen) != *gen)
+            break;
+        cost = now_ns() - start;
+        d->cb_cnt++;
+        d->cb_total_ns += cost;
+        if (cost > d->cb_max_ns)
+            d->cb_max_ns = cost;
+        n++;
+    }
+    return n;
+}
+
+int event_dispatch_drain(void *handle)
+{
+    struct event_dispatch *d = handle;
+    int n;
+
+    if (!d)
+        return -1;
+    pthread_mutex_lock(&d->drain_lock);
+    n = drain_locked(d, NULL);
+    pthread_mutex_unlock(&d->drain_lock);
+    return n;
+}
+
+static void dispatch_free(struct event_dispatch *d)
+{
+    close(d->efd);
+    pthread_mutex_destroy(&d->drain_lock);
+    pthread_mutex_destroy(&d->worker_lock);
+    free(d);
+}
+
+static void * worker_thread(void *arg)
+{
+    struct event_dispatch *d = arg;
+    struct pollfd pfd = {
+        .fd = d->efd,
+        .events = POLLIN,
+    };
+    /* a stop bumps gen, then joins or, from a callback, detaches */
+    uint32_t gen = d->start_gen;
+    bool stopped, frees = false;
+
+    prctl (PR_SET_NAME, "avs_event");
+    for (;;) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            log_error("poll errno %d", errno);
+            break;
+        }
+        pthread_mutex_lock(&d->drain_lock);
+        drain_locked(d, &gen);
+        /* once detached, @d may be freed or restarted after unlock */
+        stopped = atomic_load(&d->gen) != gen;
+        frees = d->worker_frees;
+        pthread_mutex_unlock(&d->drain_lock);
+        if (stopped)
+            break;
+    }
+    if (frees)
+        dispatch_free(d);
+    return NULL;
+}
+
+int event_dispatch_start_worker(void *handle)
+{
+    struct event_dispatch *d = handle;
+    int ret = 0;
+
+    if (!d)
+        return -1;
+    pthread_mutex_lock(&d->worker_lock);
+    if (!d->worker_running) {
+        d->start_gen = atomic_load(&d->gen);
+        ret = pthread_create(&d->worker, NULL, worker_thread, d);
+        if (ret)
+            log_error("create worker errno %d", ret);
+        else
+            d->worker_running = true;
+    }
+    pthread_mutex_unlock(&d->worker_lock);
+    return ret ? -1 : 0;
+}
+
+/* Returns true when called from a callback on the worker. The worker
+ * is detached then, it leaves once the callback returns and still
+ * holds drain_lock until it does.
+ */
+static bool stop_worker(struct event_dispatch *d)
+{
+    bool self = false;
+
+    pthread_mutex_lock(&d->worker_lock);
+    if (d->worker_running) {
+        atomic_fetch_add(&d->gen, 1);
+        if (pthread_equal(pthread_self(), d->worker)) {
+            pthread_detach(d->worker);
+            self = true;
+        } else {
+            wake(d);
+            pthread_join(d->worker, NULL);
+        }
+        d->worker_running = false;
+    }
+    pthread_mutex_unlock(&d->worker_lock);
+    return self;
+}
+
+int event_dispatch_get_fd(void *handle)
+{
+    struct event_dispatch *d = handle;
+
+    if (!d)
+        return -1;
+    stop_worker(d);
+    /* the worker may have eaten a wake up of pending events */
+    if (atomic_load(&d->wi) != atomic_load(&d->ri))
+        wake(d);
+    return d->efd;
+}
+
+void event_dispatch_get_stats(void *handle, uint64_t *cnt,
+        uint64_t *total_ns, uint64_t *max_ns, uint64_t *lost)
+{
+    struct event_dispatch *d = handle;
+
+    if (!d)
+        return;
+    *cnt = d->cb_cnt;
+    *total_ns = d->cb_total_ns;
+    *max_ns = d->cb_max_ns;
+    *lost = atomic_load(&d->lost);
+}
+
+void event_dispatch_reset(void *handle)
+{
+    struct event_dispatch *d = handle;
+
+    if (!d)
+        return;
+    if (stop_worker(d))
+        /* from a callback, events left are of the session going away */
+        atomic_store(&d->ri, atomic_load(&d->wi));
+    else
+        event_dispatch_drain(d);
+    d->cb_cnt = 0;
+    d->cb_total_ns = 0;
+    d->cb_max_ns = 0;
+    atomic_store(&d->lost, 0);
+}
+
+void event_dispatch_destroy(void *handle)
+{
+    struct event_dispatch *d = handle;
+
+    if (!d)
+        return;
+    if (stop_worker(d)) {
+        d->worker_frees = true;
+        return;
+    }
+    event_dispatch_drain(d);
+    dispatch_free(d);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: deferred client callbacks of one session.
+ * Events are posted lock-free by a single thread (VSYNC) and handled
+ * either by a worker thread or by whoever drains the exported eventfd.
+ */
+#ifndef AML_AVSYNC_EVENT_DISPATCH_H
+#define AML_AVSYNC_EVENT_DISPATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum session_event_type {
+    SESSION_EVT_PAUSE_PTS,
+    SESSION_EVT_UNDERFLOW,
+};
+
+typedef void (*event_handler)(void *priv, int type, uint32_t pts);
+
+void* event_dispatch_create(event_handler handler, void *priv);
+/* remaining events are handled before it returns */
+void event_dispatch_destroy(void *handle);
+/* like destroy, but keeps it for reuse with zeroed stats */
+void event_dispatch_reset(void *handle);
+/* single poster only, never blocks */
+int event_dispatch_post(void *handle, int type, uint32_t pts);
+/* handle events on a worker thread, started on first call */
+int event_dispatch_start_worker(void *handle);
+/* stop worker if any, return eventfd readable while events pending */
+int event_dispatch_get_fd(void *handle);
+/* handle pending events on the calling thread */
+int event_dispatch_drain(void *handle);
+void event_dispatch_get_stats(void *handle, uint64_t *cnt,
+        uint64_t *total_ns, uint64_t *max_ns, uint64_t *lost);
+
+#endif
@@ -126,6 +126,44 @@ struct ker_start_policy {
     int timeout;
 };
 
+/* Read-only page mapped from session fd at offset 0.
+ * Published with a seqlock: seq is odd while the writer updates it.
+ * wall = wall_clock + (now - mono_ts) * rate / 1000 * (1 + ppm / 10^6)
+ */
+struct wall_snapshot {
+	uint32_t seq;
+	/* WALL_SNAP_* */
+	uint32_t flags;
+	uint32_t wall_clock;
+	/* speed x 1000 */
+	uint32_t rate;
+	int32_t ppm;
+	/* vsync interval in 90K */
+	uint32_t interval;
+	/* CLOCK_MONOTONIC_RAW in ns when wall_clock was sampled */
+	uint64_t mono_ts;
+};
+
+#define WALL_SNAP_VALID		0x1
+#define WALL_SNAP_PAUSED	0x2
+#define WALL_SNAP_SIZE		4096
+
+/* One round trip per vsync: report the frame presented on the
+ * previous vsync, then read back wall clock for the current one.
+ */
+struct vsync_txn {
+	/* in VSYNC_TXN_* */
+	uint32_t flags;
+	/* in frame of previous vsync, valid with VSYNC_TXN_VPTS */
+	struct pts_tri vpts;
+	/* out */
+	uint32_t wall_clock;
+	uint32_t interval;
+	uint32_t clock_started;
+};
+
+#define VSYNC_TXN_VPTS		0x1
+
 #define AVS_INVALID_PTS 0xFFFFFFFFUL
 
 #define AMSYNC_START_V_FIRST 0x1
@@ -164,6 +202,7 @@ struct ker_start_policy {
 #define AMSYNCS_IOC_SET_CLK_DEV	_IOW((_A_M_SS), 0x14, int)
 #define AMSYNCS_IOC_GET_CLK_DEV	_IOR((_A_M_SS), 0x15, int)
 #define AMSYNCS_IOC_SET_STOP_AUDIO_WAIT	_IOR((_A_M_SS), 0x16, int)
+#define AMSYNCS_IOC_VSYNC_TXN	_IOWR((_A_M_SS), 0x17, struct vsync_txn)
 
 //For debuging
 #define AMSYNCS_IOC_GET_DEBUG_MODE      _IOR((_A_M_SS), 0x100, struct session_debug)
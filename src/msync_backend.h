@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ * msync backend ops. Every device/sysfs access of msync_util goes
+ * through one of these tables.
+ *
+ * Author: song.zhao@amlogic.com
+ */
+#ifndef MSYNC_BACKEND_H
+#define MSYNC_BACKEND_H
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+
+struct msync_backend {
+    const char *name;
+    /* device nodes and sysfs attributes */
+    int (*open)(const char *path, int flags);
+    /* wait up to @timeout ms until node @path shows up */
+    int (*wait_node)(const char *path, int timeout);
+    int (*close)(int fd);
+    int (*ioctl)(int fd, unsigned long request, void *arg);
+    /* POLLPRI on session fd reports mode change */
+    int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+    /* epoll bit of that mode change notification */
+    uint32_t notify_events;
+    int (*epoll_wait)(int epfd, struct epoll_event *events,
+            int maxevents, int timeout);
+    ssize_t (*pread)(int fd, void *buf, size_t count, off_t offset);
+    ssize_t (*pwrite)(int fd, const void *buf, size_t count, off_t offset);
+    /* read-only struct wall_snapshot of session fd, NULL if unsupported */
+    void *(*mmap)(int fd, size_t length);
+    void (*munmap)(void *addr, size_t length);
+};
+
+/* /dev/aml_msync and /dev/avsync_sN of the msync kernel driver */
+extern const struct msync_backend msync_kernel_backend;
+/* in-process stand-in of the kernel driver, see msync_user.c */
+extern const struct msync_backend msync_user_backend;
+
+/* Selected once per process.
+ * AML_AVSYNC_BACKEND=user picks the userspace backend,
+ * anything else the kernel one.
+ */
+const struct msync_backend *msync_get_backend(void);
+
+#endif
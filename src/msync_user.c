@@ -0,0 +1,1018 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ * In-process stand-in of the msync kernel driver. It emulates session
+ * allocation, the session wall clock, start policies, pause/resume, rate,
+ * clock deviation, discontinuity events and POLLPRI mode change
+ * notification, so the library can run on a host without Amlogic kernel.
+ * Session fds are eventfds, so poll() on them blocks like on the driver.
+ * The wall snapshot page is published for mmap() readers as well.
+ *
+ * Author: song.zhao@amlogic.com
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include "msync.h"
+#include "aml_avsync_log.h"
+#include "msync_backend.h"
+
+#define USER_MAX_SESSION 64
+#define USER_MAX_FD 256
+#define USER_MAX_POLL_FD 16
+#define USER_DEF_VSYNC_INTERVAL 1500 //60Hz
+#define USER_DEF_WALL_ADJ_THRES (90000 / 10)
+#define USER_DEF_DISC_THRES_MIN (90000 / 3)
+#define USER_DEF_DISC_THRES_MAX (90000 * 10)
+#define USER_AUDIO_LATE_THRES (90000 / 10)
+#define NS_PER_SEC 1000000000LL
+/* demod locks this long after first open, SFO about +20 ppm */
+#define USER_DEMOD_LOCK_MS 500
+#define USER_DEMOD_SFO_REG 0x5d9
+#define USER_DEMOD_LOCKED 0x1f
+
+enum node_type {
+    NODE_NONE = 0,
+    NODE_MSYNC,
+    NODE_SESSION,
+    NODE_DISC_MIN,
+    NODE_DISC_MAX,
+    NODE_START_BUF_THRES,
+    NODE_VOUT_MODE,
+    NODE_DEMOD,
+};
+
+struct user_node {
+    enum node_type type;
+    /* session id for NODE_SESSION/NODE_DISC_*
+     * allocated session id for NODE_MSYNC, -1 for none
+     */
+    int id;
+};
+
+struct user_session {
+    bool used;
+    int ref;
+
+    /* enum av_sync_mode */
+    uint32_t mode;
+    uint32_t policy;
+    int timeout;
+    /* enum av_sync_stat */
+    uint32_t stat;
+    bool v_active;
+    bool a_active;
+    bool v_timeout;
+    bool audio_switch;
+
+    /* wall clock: wall = anchor + (mono - mono_anchor) * rate * (1 + ppm) */
+    bool clock_started;
+    bool wall_valid;
+    bool paused;
+    uint32_t wall_anchor;
+    uint64_t mono_anchor;
+    uint32_t rate;
+    int32_t clk_dev;
+    uint32_t wall_adj_thres;
+
+    /* pending asynchronous audio start */
+    bool a_waiting;
+    uint32_t a_start_pts;
+    uint32_t a_start_delay;
+    uint64_t a_deadline;
+
+    struct pts_tri vts;
+    struct pts_tri ats;
+    struct pcr_pair pcr;
+    bool pcr_valid;
+
+    uint32_t disc_thres_min;
+    uint32_t disc_thres_max;
+    char name[32];
+};
+
+static pthread_mutex_t ulock = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when a session node shows up */
+static pthread_cond_t node_cond = PTHREAD_COND_INITIALIZER;
+static struct user_session sessions[USER_MAX_SESSION];
+static struct user_node nodes[USER_MAX_FD];
+/* kept out of sessions[] so that mappings survive session reset */
+static struct wall_snapshot pages[USER_MAX_SESSION];
+static uint32_t start_buf_thres;
+static uint64_t demod_open_ns;
+/* wakes epoll waiters when a new timer is armed, they then re-arm */
+static int timer_fd = -1;
+
+static uint64_t mono_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+static struct user_node *get_node(int fd)
+{
+    if (fd < 0 || fd >= USER_MAX_FD || nodes[fd].type == NODE_NONE)
+        return NULL;
+    return &nodes[fd];
+}
+
+/* 90K ticks elapsed in @ns of mono time under current rate/deviation */
+static int64_t wall_ticks(struct user_session *s, int64_t ns)
+{
+    int64_t ticks;
+
+    ticks = ns * 9 / 100000 * s->rate / 1000;
+    ticks += ticks * s->clk_dev / 1000000;
+    return ticks;
+}
+
+static uint32_t wall_at(struct user_session *s, uint64_t mono)
+{
+    if (!s->wall_valid)
+        return AVS_INVALID_PTS;
+    if (s->paused)
+        return s->wall_anchor;
+    return s->wall_anchor + (uint32_t)wall_ticks(s, (int64_t)(mono - s->mono_anchor));
+}
+
+static void set_wall(struct user_session *s, uint32_t wall, uint64_t mono)
+{
+    s->wall_anchor = wall;
+    s->mono_anchor = mono;
+    s->wall_valid = true;
+    if (!s->clock_started) {
+        s->clock_started = true;
+        s->stat = s->paused ? AVS_STAT_PAUSED : AVS_STAT_STARTED;
+    }
+}
+
+/* keep wall continuous before rate/deviation/pause change */
+static void rebase_wall(struct user_session *s, uint64_t now)
+{
+    if (!s->wall_valid)
+        return;
+    s->wall_anchor = wall_at(s, now);
+    s->mono_anchor = now;
+}
+
+static void publish(int id)
+{
+    struct user_session *s = &sessions[id];
+    struct wall_snapshot *page = &pages[id];
+    uint32_t flags = 0;
+
+    if (s->wall_valid)
+        flags |= WALL_SNAP_VALID;
+    if (s->paused)
+        flags |= WALL_SNAP_PAUSED;
+
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&page->flags, flags, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->wall_clock, s->wall_anchor, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->rate, s->rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->ppm, s->clk_dev, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->interval, USER_DEF_VSYNC_INTERVAL, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->mono_ts, s->mono_anchor, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void notify(int id)
+{
+    uint64_t v = 1;
+    int fd;
+
+    for (fd = 0; fd < USER_MAX_FD; fd++) {
+        if (nodes[fd].type == NODE_SESSION && nodes[fd].id == id) {
+            if (write(fd, &v, sizeof(v)) != sizeof(v))
+                log_debug("session[%d] notify errno:%d", id, errno);
+        }
+    }
+}
+
+static void clean_poll(int fd)
+{
+    uint64_t v;
+
+    if (read(fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        log_debug("fd[%d] clean poll errno:%d", fd, errno);
+}
+
+static void reset_session(struct user_session *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->mode = AVS_MODE_FREE_RUN;
+    s->policy = AMSYNC_START_ASAP;
+    s->stat = AVS_STAT_INIT;
+    s->rate = 1000;
+    s->wall_adj_thres = USER_DEF_WALL_ADJ_THRES;
+    s->disc_thres_min = USER_DEF_DISC_THRES_MIN;
+    s->disc_thres_max = USER_DEF_DISC_THRES_MAX;
+    s->vts.pts = s->ats.pts = AVS_INVALID_PTS;
+    s->pcr.pts = AVS_INVALID_PTS;
+}
+
+static void put_session(int id)
+{
+    struct user_session *s = &sessions[id];
+
+    if (--s->ref <= 0) {
+        log_debug("session[%d] released", id);
+        s->used = false;
+    }
+}
+
+static void audio_release(int id, struct user_session *s, bool timeout, uint64_t now)
+{
+    s->a_waiting = false;
+    if (timeout || !s->v_active)
+        s->v_timeout = true;
+    if (!s->wall_valid || s->mode == AVS_MODE_A_MASTER)
+        set_wall(s, s->a_start_pts - s->a_start_delay, now);
+    log_debug("session[%d] audio released timeout %d", id, timeout);
+    notify(id);
+}
+
+/* release audio waiting for video/wall/timeout.
+ * Returns ns until the next check is due, -1 for none.
+ */
+static int64_t session_tick(int id, struct user_session *s, uint64_t now)
+{
+    uint32_t wall, target;
+    int64_t due = -1;
+
+    if (!s->a_waiting)
+        return -1;
+
+    if (s->a_deadline && now >= s->a_deadline) {
+        audio_release(id, s, true, now);
+        return -1;
+    }
+
+    if (s->wall_valid && !s->paused) {
+        wall = wall_at(s, now);
+        target = s->a_start_pts - s->a_start_delay;
+        if ((int)(wall - target) >= 0) {
+            audio_release(id, s, false, now);
+            return -1;
+        }
+        due = (int64_t)(target - wall) * 100000 / 9;
+        due = due * 1000 / s->rate;
+    }
+    if (s->a_deadline) {
+        int64_t to = s->a_deadline - now;
+        if (due < 0 || to < due)
+            due = to;
+    }
+    return due;
+}
+
+static int64_t tick_all(uint64_t now)
+{
+    int64_t due, next = -1;
+    int i;
+
+    for (i = 0; i < USER_MAX_SESSION; i++) {
+        if (!sessions[i].used)
+            continue;
+        due = session_tick(i, &sessions[i], now);
+        publish(i);
+        if (due >= 0 && (next < 0 || due < next))
+            next = due;
+    }
+    return next;
+}
+
+static void kick_timer(void)
+{
+    uint64_t v = 1;
+
+    if (timer_fd >= 0 && write(timer_fd, &v, sizeof(v)) != sizeof(v))
+        log_error("timer kick errno %d", errno);
+}
+
+static uint32_t audio_start(int id, struct user_session *s,
+        uint32_t pts, uint32_t delay, uint64_t now)
+{
+    uint32_t start = pts - delay;
+    uint32_t wall;
+
+    s->a_active = true;
+    s->a_start_pts = pts;
+    s->a_start_delay = delay;
+    s->a_deadline = 0;
+
+    if (s->mode == AVS_MODE_FREE_RUN) {
+        if (!s->wall_valid)
+            set_wall(s, start, now);
+        return AVS_START_SYNC;
+    }
+
+    if (!s->wall_valid) {
+        /* wait for video or PCR, but not forever */
+        if (s->mode == AVS_MODE_A_MASTER &&
+                (s->policy == AMSYNC_START_ASAP ||
+                 s->policy == AMSYNC_START_A_FIRST)) {
+            set_wall(s, start, now);
+            return AVS_START_SYNC;
+        }
+        s->a_waiting = true;
+        if (s->timeout > 0) {
+            s->a_deadline = now + (uint64_t)s->timeout * 1000000;
+            kick_timer();
+        }
+        return AVS_START_ASYNC;
+    }
+
+    wall = wall_at(s, now);
+    if ((int)(wall - start) > USER_AUDIO_LATE_THRES &&
+            s->mode != AVS_MODE_A_MASTER) {
+        /* late, drop and try again */
+        s->a_active = false;
+        return AVS_START_AGAIN;
+    }
+    if ((int)(start - wall) > 0 && s->mode != AVS_MODE_A_MASTER) {
+        /* early, hold until wall reaches it */
+        s->a_waiting = true;
+        return AVS_START_ASYNC;
+    }
+    if (s->mode == AVS_MODE_A_MASTER)
+        set_wall(s, start, now);
+    return AVS_START_SYNC;
+}
+
+static void video_start(int id, struct user_session *s, uint32_t pts, uint64_t now)
+{
+    s->v_active = true;
+
+    switch (s->mode) {
+    case AVS_MODE_V_MASTER:
+    case AVS_MODE_FREE_RUN:
+        set_wall(s, pts, now);
+        break;
+    case AVS_MODE_A_MASTER:
+        if (s->a_waiting) {
+            /* align to the later one */
+            uint32_t astart = s->a_start_pts - s->a_start_delay;
+            set_wall(s, (int)(astart - pts) > 0 ? astart : pts, now);
+        } else if (!s->wall_valid && s->policy != AMSYNC_START_ALIGN) {
+            set_wall(s, pts, now);
+        }
+        break;
+    case AVS_MODE_IPTV:
+        if (!s->wall_valid)
+            set_wall(s, pts, now);
+        break;
+    case AVS_MODE_PCR_MASTER:
+    default:
+        break;
+    }
+}
+
+/* re-anchor wall to master timestamp when it drifts beyond threshold */
+static void master_ts(struct user_session *s, struct pts_tri *ts)
+{
+    uint32_t wall;
+
+    if (!s->wall_valid || s->paused)
+        return;
+    wall = wall_at(s, ts->mono_ts);
+    if ((uint32_t)abs((int)(wall - ts->pts)) > s->wall_adj_thres) {
+        log_debug("wall %u adjusted to %u", wall, ts->pts);
+        set_wall(s, ts->pts, ts->mono_ts);
+    }
+}
+
+static int send_event(int id, struct user_session *s,
+        struct session_event *ev, uint64_t now)
+{
+    switch (ev->event) {
+    case AVS_VIDEO_START:
+        video_start(id, s, ev->value, now);
+        break;
+    case AVS_PAUSE:
+        rebase_wall(s, now);
+        s->paused = true;
+        s->stat = AVS_STAT_PAUSED;
+        break;
+    case AVS_RESUME:
+        rebase_wall(s, now);
+        s->paused = false;
+        if (s->clock_started)
+            s->stat = AVS_STAT_STARTED;
+        break;
+    case AVS_VIDEO_STOP:
+        s->v_active = false;
+        break;
+    case AVS_AUDIO_STOP:
+        s->a_active = false;
+        s->a_waiting = false;
+        break;
+    case AVS_VIDEO_TSTAMP_DISCONTINUITY:
+        if (s->mode == AVS_MODE_V_MASTER || s->mode == AVS_MODE_IPTV ||
+                (s->mode == AVS_MODE_PCR_MASTER && !s->pcr_valid))
+            set_wall(s, ev->value, now);
+        break;
+    case AVS_AUDIO_TSTAMP_DISCONTINUITY:
+        if (s->mode == AVS_MODE_A_MASTER)
+            set_wall(s, ev->value, now);
+        break;
+    case AVS_AUDIO_SWITCH:
+        s->audio_switch = ev->value;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    notify(id);
+    return 0;
+}
+
+static int session_ioctl(int fd, int id, struct user_session *s,
+        unsigned long request, void *arg)
+{
+    uint64_t now = mono_ns();
+
+    switch (request) {
+    case AMSYNCS_IOC_SET_MODE:
+        s->mode = *(uint32_t *)arg;
+        notify(id);
+        break;
+    case AMSYNCS_IOC_GET_MODE:
+        *(uint32_t *)arg = s->mode;
+        break;
+    case AMSYNCS_IOC_SET_START_POLICY:
+    {
+        struct ker_start_policy *policy = arg;
+
+        s->policy = policy->policy;
+        s->timeout = policy->timeout;
+        break;
+    }
+    case AMSYNCS_IOC_GET_START_POLICY:
+    {
+        struct ker_start_policy *policy = arg;
+
+        policy->policy = s->policy;
+        policy->timeout = s->timeout;
+        break;
+    }
+    case AMSYNCS_IOC_SET_V_TS:
+        s->vts = *(struct pts_tri *)arg;
+        if (s->mode == AVS_MODE_V_MASTER)
+            master_ts(s, &s->vts);
+        break;
+    case AMSYNCS_IOC_GET_V_TS:
+        *(struct pts_tri *)arg = s->vts;
+        break;
+    case AMSYNCS_IOC_SET_A_TS:
+        s->ats = *(struct pts_tri *)arg;
+        if (s->mode == AVS_MODE_A_MASTER)
+            master_ts(s, &s->ats);
+        break;
+    case AMSYNCS_IOC_GET_A_TS:
+        *(struct pts_tri *)arg = s->ats;
+        break;
+    case AMSYNCS_IOC_SEND_EVENT:
+        return send_event(id, s, arg, now);
+    case AMSYNCS_IOC_GET_SYNC_STAT:
+    {
+        struct session_sync_stat *stat = arg;
+
+        stat->v_active = s->v_active;
+        stat->a_active = s->a_active;
+        stat->mode = s->mode;
+        stat->v_timeout = s->v_timeout;
+        stat->audio_switch = s->audio_switch;
+        stat->stat = s->stat;
+        if (stat->clean_poll)
+            clean_poll(fd);
+        break;
+    }
+    case AMSYNCS_IOC_SET_PCR:
+    {
+        struct pcr_pair *pcr = arg;
+
+        s->pcr = *pcr;
+        s->pcr_valid = true;
+        /* anchor at arrival, clients may feed synthetic mono_clock */
+        if (s->mode == AVS_MODE_PCR_MASTER) {
+            uint32_t wall = wall_at(s, now);
+
+            if (!s->wall_valid ||
+                    (uint32_t)abs((int)(wall - pcr->pts)) > s->disc_thres_min) {
+                bool first = !s->clock_started;
+
+                set_wall(s, pcr->pts, now);
+                if (first)
+                    notify(id);
+            }
+        }
+        break;
+    }
+    case AMSYNCS_IOC_GET_PCR:
+        *(struct pcr_pair *)arg = s->pcr;
+        break;
+    case AMSYNCS_IOC_GET_WALL:
+    {
+        struct pts_wall *wall = arg;
+
+        wall->wall_clock = wall_at(s, now);
+        wall->interval = USER_DEF_VSYNC_INTERVAL;
+        wall->dis_delay = 0;
+        break;
+    }
+    case AMSYNCS_IOC_SET_RATE:
+        rebase_wall(s, now);
+        if (s->rate != *(uint32_t *)arg) {
+            s->rate = *(uint32_t *)arg;
+            notify(id);
+        }
+        break;
+    case AMSYNCS_IOC_GET_RATE:
+        *(uint32_t *)arg = s->rate;
+        break;
+    case AMSYNCS_IOC_SET_NAME:
+        strncpy(s->name, (const char *)arg, sizeof(s->name) - 1);
+        break;
+    case AMSYNCS_IOC_SET_WALL_ADJ_THRES:
+        s->wall_adj_thres = *(uint32_t *)arg;
+        break;
+    case AMSYNCS_IOC_GET_WALL_ADJ_THRES:
+        *(uint32_t *)arg = s->wall_adj_thres;
+        break;
+    case AMSYNCS_IOC_GET_CLOCK_START:
+        *(uint32_t *)arg = s->clock_started;
+        break;
+    case AMSYNCS_IOC_VSYNC_TXN:
+    {
+        struct vsync_txn *txn = arg;
+
+        if (txn->flags & VSYNC_TXN_VPTS) {
+            s->vts = txn->vpts;
+            if (s->mode == AVS_MODE_V_MASTER)
+                master_ts(s, &s->vts);
+        }
+        txn->wall_clock = wall_at(s, now);
+        txn->interval = USER_DEF_VSYNC_INTERVAL;
+        txn->clock_started = s->clock_started;
+        break;
+    }
+    case AMSYNCS_IOC_AUDIO_START:
+    {
+        struct audio_start *start = arg;
+
+        start->mode = audio_start(id, s, start->pts, start->delay, now);
+        notify(id);
+        break;
+    }
+    case AMSYNCS_IOC_SET_CLK_DEV:
+        rebase_wall(s, now);
+        s->clk_dev = *(int *)arg;
+        break;
+    case AMSYNCS_IOC_GET_CLK_DEV:
+        *(int *)arg = s->clk_dev;
+        break;
+    case AMSYNCS_IOC_SET_STOP_AUDIO_WAIT:
+        if (s->a_waiting) {
+            s->a_waiting = false;
+            s->a_active = false;
+            notify(id);
+        }
+        break;
+    case AMSYNCS_IOC_GET_DEBUG_MODE:
+        memset(arg, 0, sizeof(struct session_debug));
+        break;
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+    return 0;
+}
+
+static int user_open(const char *path, int flags)
+{
+    enum node_type type = NODE_NONE;
+    int id = -1, fd;
+
+    if (!strcmp(path, "/dev/aml_msync")) {
+        type = NODE_MSYNC;
+    } else if (sscanf(path, "/dev/avsync_s%d", &id) == 1) {
+        type = NODE_SESSION;
+    } else if (sscanf(path, "/sys/class/avsync_session%d/disc_thres_m", &id) == 1) {
+        if (strstr(path, "disc_thres_min"))
+            type = NODE_DISC_MIN;
+        else if (strstr(path, "disc_thres_max"))
+            type = NODE_DISC_MAX;
+    } else if (!strcmp(path, "/sys/class/aml_msync/start_buf_thres")) {
+        type = NODE_START_BUF_THRES;
+    } else if (!strcmp(path, "/sys/class/aml_msync/vout_mode")) {
+        type = NODE_VOUT_MODE;
+    } else if (!strcmp(path, "/sys/class/dtvdemod/atsc_para")) {
+        type = NODE_DEMOD;
+    }
+
+    if (type == NODE_NONE) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ulock);
+    if (type != NODE_MSYNC && type != NODE_START_BUF_THRES &&
+            type != NODE_VOUT_MODE && type != NODE_DEMOD &&
+            (id < 0 || id >= USER_MAX_SESSION || !sessions[id].used)) {
+        pthread_mutex_unlock(&ulock);
+        errno = ENOENT;
+        return -1;
+    }
+
+    fd = eventfd(0, EFD_NONBLOCK | ((flags & O_CLOEXEC) ? EFD_CLOEXEC : 0));
+    if (fd < 0) {
+        pthread_mutex_unlock(&ulock);
+        return -1;
+    }
+    if (fd >= USER_MAX_FD) {
+        close(fd);
+        pthread_mutex_unlock(&ulock);
+        errno = EMFILE;
+        return -1;
+    }
+    nodes[fd].type = type;
+    nodes[fd].id = id;
+    if (type == NODE_SESSION)
+        sessions[id].ref++;
+    if (type == NODE_DEMOD && !demod_open_ns)
+        demod_open_ns = mono_ns();
+    pthread_mutex_unlock(&ulock);
+    return fd;
+}
+
+static int user_close(int fd)
+{
+    struct user_node *node;
+
+    pthread_mutex_lock(&ulock);
+    node = get_node(fd);
+    if (!node) {
+        pthread_mutex_unlock(&ulock);
+        errno = EBADF;
+        return -1;
+    }
+    if ((node->type == NODE_SESSION || node->type == NODE_MSYNC) && node->id >= 0)
+        put_session(node->id);
+    node->type = NODE_NONE;
+    node->id = -1;
+    close(fd);
+    pthread_mutex_unlock(&ulock);
+    return 0;
+}
+
+static int user_wait_node(const char *path, int timeout)
+{
+    struct timespec ts;
+    int id, rc = 0;
+
+    if (sscanf(path, "/dev/avsync_s%d", &id) != 1 ||
+            id < 0 || id >= USER_MAX_SESSION)
+        return 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (timeout % 1000) * 1000000;
+    if (ts.tv_nsec >= NS_PER_SEC) {
+        ts.tv_sec++;
+        ts.tv_nsec -= NS_PER_SEC;
+    }
+    pthread_mutex_lock(&ulock);
+    while (!sessions[id].used && !rc)
+        rc = pthread_cond_timedwait(&node_cond, &ulock, &ts);
+    pthread_mutex_unlock(&ulock);
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+static int user_ioctl(int fd, unsigned long request, void *arg)
+{
+    struct user_node *node;
+    int rc = 0, i;
+
+    pthread_mutex_lock(&ulock);
+    tick_all(mono_ns());
+    node = get_node(fd);
+    if (!node) {
+        rc = -1;
+        errno = EBADF;
+    } else if (node->type == NODE_MSYNC) {
+        if (request != AMSYNC_IOC_ALLOC_SESSION || node->id >= 0) {
+            rc = -1;
+            errno = EINVAL;
+            goto exit;
+        }
+        for (i = 0; i < USER_MAX_SESSION; i++) {
+            if (!sessions[i].used)
+                break;
+        }
+        if (i == USER_MAX_SESSION) {
+            rc = -1;
+            errno = EBUSY;
+            goto exit;
+        }
+        reset_session(&sessions[i]);
+        publish(i);
+        sessions[i].used = true;
+        sessions[i].ref = 1;
+        pthread_cond_broadcast(&node_cond);
+        node->id = i;
+        *(int *)arg = i;
+    } else if (node->type == NODE_SESSION) {
+        rc = session_ioctl(fd, node->id, &sessions[node->id], request, arg);
+        publish(node->id);
+    } else {
+        rc = -1;
+        errno = ENOTTY;
+    }
+exit:
+    pthread_mutex_unlock(&ulock);
+    return rc;
+}
+
+static int user_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    struct pollfd pfd[USER_MAX_POLL_FD];
+    bool mapped[USER_MAX_POLL_FD];
+    uint64_t deadline = 0;
+    int64_t due;
+    int rc, wait_ms;
+    nfds_t i;
+
+    if (nfds > USER_MAX_POLL_FD) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (timeout >= 0)
+        deadline = mono_ns() + (uint64_t)timeout * 1000000;
+
+    for (;;) {
+        pthread_mutex_lock(&ulock);
+        due = tick_all(mono_ns());
+        for (i = 0; i < nfds; i++) {
+            struct user_node *node = get_node(fds[i].fd);
+
+            pfd[i] = fds[i];
+            mapped[i] = node && node->type == NODE_SESSION;
+            /* eventfd reports pending notification as POLLIN */
+            if (mapped[i] && (fds[i].events & POLLPRI))
+                pfd[i].events = POLLIN;
+        }
+        pthread_mutex_unlock(&ulock);
+
+        wait_ms = -1;
+        if (timeout >= 0) {
+            uint64_t now = mono_ns();
+            wait_ms = now >= deadline ? 0 : (deadline - now + 999999) / 1000000;
+        }
+        if (due >= 0) {
+            int due_ms = (due + 999999) / 1000000;
+            if (wait_ms < 0 || due_ms < wait_ms)
+                wait_ms = due_ms;
+        }
+
+        rc = poll(pfd, nfds, wait_ms);
+        if (rc < 0)
+            return rc;
+        for (i = 0; i < nfds; i++) {
+            fds[i].revents = pfd[i].revents;
+            if (mapped[i] && (pfd[i].revents & POLLIN))
+                fds[i].revents = (fds[i].revents & ~POLLIN) | POLLPRI;
+        }
+        if (rc > 0)
+            return rc;
+        if (timeout >= 0 && mono_ns() >= deadline)
+            return 0;
+        /* woken up for internal timer only */
+    }
+}
+
+static ssize_t user_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    struct user_node *node;
+    char valstr[64];
+    size_t len;
+
+    pthread_mutex_lock(&ulock);
+    node = get_node(fd);
+    if (!node) {
+        pthread_mutex_unlock(&ulock);
+        errno = EBADF;
+        return -1;
+    }
+    switch (node->type) {
+    case NODE_DISC_MIN:
+        snprintf(valstr, sizeof(valstr), "%u\n", sessions[node->id].disc_thres_min);
+        break;
+    case NODE_DISC_MAX:
+        snprintf(valstr, sizeof(valstr), "%u\n", sessions[node->id].disc_thres_max);
+        break;
+    case NODE_START_BUF_THRES:
+        snprintf(valstr, sizeof(valstr), "%u\n", start_buf_thres);
+        break;
+    case NODE_VOUT_MODE:
+        snprintf(valstr, sizeof(valstr), "den %d num %d inc %d\n",
+                1, 60, USER_DEF_VSYNC_INTERVAL);
+        break;
+    case NODE_DEMOD:
+        snprintf(valstr, sizeof(valstr), "ck=0x%x lock=%d\n",
+                USER_DEMOD_SFO_REG,
+                mono_ns() - demod_open_ns >=
+                (uint64_t)USER_DEMOD_LOCK_MS * 1000000 ? USER_DEMOD_LOCKED : 0);
+        break;
+    default:
+        pthread_mutex_unlock(&ulock);
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_unlock(&ulock);
+
+    len = strlen(valstr);
+    if (offset >= len)
+        return 0;
+    len -= offset;
+    if (len > count)
+        len = count;
+    memcpy(buf, valstr + offset, len);
+    return len;
+}
+
+static ssize_t user_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    struct user_node *node;
+    char valstr[64];
+    uint32_t val;
+
+    if (count >= sizeof(valstr)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(valstr, buf, count);
+    valstr[count] = '\0';
+    if (sscanf(valstr, "%u", &val) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ulock);
+    node = get_node(fd);
+    if (!node) {
+        pthread_mutex_unlock(&ulock);
+        errno = EBADF;
+        return -1;
+    }
+    switch (node->type) {
+    case NODE_DISC_MIN:
+        sessions[node->id].disc_thres_min = val;
+        break;
+    case NODE_DISC_MAX:
+        sessions[node->id].disc_thres_max = val;
+        break;
+    case NODE_START_BUF_THRES:
+        start_buf_thres = val;
+        break;
+    case NODE_DEMOD:
+        /* register select, only SFO is emulated */
+        break;
+    default:
+        pthread_mutex_unlock(&ulock);
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_unlock(&ulock);
+    return count;
+}
+
+static void *user_mmap(int fd, size_t length)
+{
+    struct user_node *node;
+    void *page = NULL;
+
+    pthread_mutex_lock(&ulock);
+    node = get_node(fd);
+    if (node && node->type == NODE_SESSION && length <= WALL_SNAP_SIZE)
+        page = &pages[node->id];
+    else
+        errno = ENODEV;
+    pthread_mutex_unlock(&ulock);
+    return page;
+}
+
+static void user_munmap(void *addr, size_t length)
+{
+}
+
+/* remove timer kicks from epoll result */
+static int strip_timer(struct epoll_event *events, int n)
+{
+    uint64_t cnt;
+    int i, j;
+
+    for (i = 0, j = 0; i < n; i++) {
+        if (events[i].data.fd == timer_fd) {
+            read(timer_fd, &cnt, sizeof(cnt));
+            continue;
+        }
+        events[j++] = events[i];
+    }
+    return j;
+}
+
+/* session eventfds report notification as EPOLLIN */
+static int user_epoll_wait(int epfd, struct epoll_event *events,
+        int maxevents, int timeout)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+    };
+    uint64_t deadline = 0;
+    int64_t due;
+    int rc, wait_ms;
+
+    if (timeout >= 0)
+        deadline = mono_ns() + (uint64_t)timeout * 1000000;
+
+    pthread_mutex_lock(&ulock);
+    if (timer_fd < 0)
+        timer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_unlock(&ulock);
+    if (timer_fd < 0)
+        return -1;
+    /* a waiter blocking forever still has to see new audio deadlines */
+    ev.data.fd = timer_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev) && errno != EEXIST)
+        return -1;
+
+    for (;;) {
+        pthread_mutex_lock(&ulock);
+        due = tick_all(mono_ns());
+        pthread_mutex_unlock(&ulock);
+
+        wait_ms = -1;
+        if (timeout >= 0) {
+            uint64_t now = mono_ns();
+            wait_ms = now >= deadline ? 0 : (deadline - now + 999999) / 1000000;
+        }
+        if (due >= 0) {
+            int due_ms = (due + 999999) / 1000000;
+            if (wait_ms < 0 || due_ms < wait_ms)
+                wait_ms = due_ms;
+        }
+
+        rc = epoll_wait(epfd, events, maxevents, wait_ms);
+        if (rc > 0)
+            rc = strip_timer(events, rc);
+        if (rc != 0)
+            return rc;
+        if (timeout >= 0 && mono_ns() >= deadline)
+            return 0;
+        /* woken up for internal timer only */
+    }
+}
+
+const struct msync_backend msync_user_backend = {
+    .name = "user",
+    .open = user_open,
+    .wait_node = user_wait_node,
+    .close = user_close,
+    .ioctl = user_ioctl,
+    .poll = user_poll,
+    .notify_events = EPOLLIN,
+    .epoll_wait = user_epoll_wait,
+    .pread = user_pread,
+    .pwrite = user_pwrite,
+    .mmap = user_mmap,
+    .munmap = user_munmap,
+};
@@ -23,21 +23,189 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <linux/types.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "msync.h"
 #include "aml_avsync_log.h"
 #include "msync_util.h"
+#include "msync_backend.h"
 
 #define MSYNC_DEV "/dev/aml_msync"
+#define SESSION_DEV "/dev/avsync_s"
 #define VOUT_MODE_DEV "/sys/class/aml_msync/vout_mode"
 
+static int kernel_open(const char *path, int flags)
+{
+    return open(path, flags);
+}
+
+static int64_t mono_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Kept open with its watches, tearing a watch down waits for an
+ * SRCU grace period, which costs more than the wait itself.
+ * Waiters share node_ifd: one polls it at a time, the others sleep on
+ * node_cond. Every drain bumps node_gen and wakes them all, so none
+ * misses the event the poller ate. node_lock covers all of it but the
+ * poll and the access() checks.
+ */
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t node_cond = PTHREAD_COND_INITIALIZER;
+static int node_ifd = -1;
+static uint32_t node_gen;
+static bool node_polling;
+
+static void node_cond_wait(int64_t left)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += left / 1000;
+    ts.tv_nsec += (left % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&node_cond, &node_lock, &ts);
+}
+
+/* udev creates the node after session allocation, then fixes its mode */
+static int kernel_wait_node(const char *path, int timeout)
+{
+    char dir[64], buf[1024];
+    const char *base = strrchr(path, '/');
+    int64_t deadline = mono_ms() + timeout, left;
+    struct pollfd pfd;
+    uint32_t gen;
+    int ifd = -1;
+
+    if (!access(path, R_OK))
+        return 0;
+    if (!base || base == path || base - path >= (int)sizeof(dir)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(dir, path, base - path);
+    dir[base - path] = '\0';
+
+    pthread_mutex_lock(&node_lock);
+    if (node_ifd < 0)
+        node_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    /* same watch if @dir is already watched */
+    if (node_ifd >= 0 && inotify_add_watch(node_ifd, dir,
+                IN_CREATE | IN_ATTRIB | IN_MOVED_TO) >= 0)
+        ifd = node_ifd;
+    pthread_mutex_unlock(&node_lock);
+    if (ifd < 0)
+        return -1;
+    pfd.fd = ifd;
+    pfd.events = POLLIN;
+
+    pthread_mutex_lock(&node_lock);
+    for (;;) {
+        gen = node_gen;
+        pthread_mutex_unlock(&node_lock);
+        if (!access(path, R_OK))
+            return 0;
+        left = deadline - mono_ms();
+        if (left <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        pthread_mutex_lock(&node_lock);
+        if (gen != node_gen)
+            /* drained since the check, it may be our event */
+            continue;
+        if (node_polling) {
+            node_cond_wait(left);
+            continue;
+        }
+        node_polling = true;
+        pthread_mutex_unlock(&node_lock);
+        poll(&pfd, 1, left);
+        pthread_mutex_lock(&node_lock);
+        node_polling = false;
+        while (read(ifd, buf, sizeof(buf)) > 0)
+            ;
+        /* also hands polling over if we time out */
+        node_gen++;
+        pthread_cond_broadcast(&node_cond);
+    }
+}
+
+static int kernel_ioctl(int fd, unsigned long request, void *arg)
+{
+    return ioctl(fd, request, arg);
+}
+
+static void *kernel_mmap(int fd, size_t length)
+{
+    void *addr;
+
+    addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+static void kernel_munmap(void *addr, size_t length)
+{
+    munmap(addr, length);
+}
+
+const struct msync_backend msync_kernel_backend = {
+    .name = "kernel",
+    .open = kernel_open,
+    .wait_node = kernel_wait_node,
+    .close = close,
+    .ioctl = kernel_ioctl,
+    .poll = poll,
+    .notify_events = EPOLLPRI,
+    .epoll_wait = epoll_wait,
+    .pread = pread,
+    .pwrite = pwrite,
+    .mmap = kernel_mmap,
+    .munmap = kernel_munmap,
+};
+
+static const struct msync_backend *backend = &msync_kernel_backend;
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+
+static void backend_select(void)
+{
+    const char *env = getenv("AML_AVSYNC_BACKEND");
+
+    if (env && !strcmp(env, "user"))
+        backend = &msync_user_backend;
+    log_info("msync backend: %s", backend->name);
+}
+
+const struct msync_backend *msync_get_backend(void)
+{
+    pthread_once(&backend_once, backend_select);
+    return backend;
+}
+
+static inline int msync_ioctl(int fd, unsigned long request, void *arg)
+{
+    return msync_get_backend()->ioctl(fd, request, arg);
+}
+
 int msync_create_session()
 {
     int fd;
 
-    fd = open(MSYNC_DEV, O_RDONLY | O_CLOEXEC);
+    fd = msync_get_backend()->open(MSYNC_DEV, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
         log_error("%s errno:%d", MSYNC_DEV, errno);
         return -1;
@@ -47,7 +215,59 @@ int msync_create_session()
 
 void msync_destory_session(int fd)
 {
-    close(fd);
+    msync_get_backend()->close(fd);
+}
+
+int msync_alloc_session(int fd, int *id)
+{
+    return msync_ioctl(fd, AMSYNC_IOC_ALLOC_SESSION, id);
+}
+
+int msync_session_open(int session_id)
+{
+    char dev_name[20];
+
+    snprintf(dev_name, sizeof(dev_name), "%s%d", SESSION_DEV, session_id);
+    return msync_get_backend()->open(dev_name, O_RDONLY | O_CLOEXEC);
+}
+
+int msync_session_open_wait(int session_id, int timeout)
+{
+    const struct msync_backend *b = msync_get_backend();
+    char dev_name[20];
+    int fd;
+
+    snprintf(dev_name, sizeof(dev_name), "%s%d", SESSION_DEV, session_id);
+    fd = b->open(dev_name, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 || (errno != ENOENT && errno != EACCES))
+        return fd;
+
+    if (b->wait_node(dev_name, timeout)) {
+        log_error("%s not ready in %d ms errno %d", dev_name, timeout, errno);
+        return -1;
+    }
+    return b->open(dev_name, O_RDONLY | O_CLOEXEC);
+}
+
+void msync_session_close(int fd)
+{
+    msync_get_backend()->close(fd);
+}
+
+int msync_session_poll(struct pollfd *fds, int nfds, int timeout)
+{
+    return msync_get_backend()->poll(fds, nfds, timeout);
+}
+
+uint32_t msync_session_notify_events(void)
+{
+    return msync_get_backend()->notify_events;
+}
+
+int msync_session_epoll_wait(int epfd, struct epoll_event *events,
+        int maxevents, int timeout)
+{
+    return msync_get_backend()->epoll_wait(epfd, events, maxevents, timeout);
 }
 
 int msync_session_set_mode(int fd, enum sync_mode mode)
@@ -66,7 +286,7 @@ int msync_session_set_mode(int fd, enum sync_mode mode)
     else if (mode == AV_SYNC_MODE_FREE_RUN)
         kmode = AVS_MODE_FREE_RUN;
 
-    rc = ioctl(fd, AMSYNCS_IOC_SET_MODE, &kmode);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SET_MODE, &kmode);
     if (rc)
         log_error("session[%d] set mode errno:%d", fd, errno);
     return rc;
@@ -77,7 +297,7 @@ int msync_session_get_mode(int fd, enum sync_mode *mode)
     int rc;
     uint32_t kmode;
 
-    rc = ioctl(fd, AMSYNCS_IOC_GET_MODE, &kmode);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_GET_MODE, &kmode);
     if (rc) {
         log_error("session[%d] set mode errno:%d", fd, errno);
         return rc;
@@ -102,7 +322,7 @@ int msync_session_get_start_policy(int fd, uint32_t *policy, int *timeout)
     int rc;
     struct ker_start_policy kpolicy;
 
-    rc = ioctl(fd, AMSYNCS_IOC_GET_START_POLICY, &kpolicy);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_GET_START_POLICY, &kpolicy);
     if (rc)
         log_error("session[%d] get start policy errno:%d", fd, errno);
 
@@ -140,7 +360,7 @@ int msync_session_set_start_policy(int fd, uint32_t policy, int timeout)
 
     kpolicy.timeout = timeout;
 
-    rc = ioctl(fd, AMSYNCS_IOC_SET_START_POLICY, &kpolicy);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SET_START_POLICY, &kpolicy);
     if (rc)
         log_error("session[%d] set start policy errno:%d", fd, errno);
     return rc;
@@ -154,7 +374,7 @@ static int msync_session_set_event(int fd, enum avs_event event, uint32_t value)
     sevent.event = event;
     sevent.value = value;
 
-    rc = ioctl(fd, AMSYNCS_IOC_SEND_EVENT, &sevent);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SEND_EVENT, &sevent);
     if (rc)
         log_error("session[%d] send %d errno:%d", fd, event, errno);
     return rc;
@@ -174,7 +394,7 @@ int msync_session_get_wall(int fd, uint32_t *wall, uint32_t *interval)
     int rc;
     struct pts_wall pwall;
 
-    rc = ioctl(fd, AMSYNCS_IOC_GET_WALL, &pwall);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_GET_WALL, &pwall);
     if (rc)
         log_error("session[%d] get wall errno:%d", fd, errno);
 
@@ -184,15 +404,93 @@ int msync_session_get_wall(int fd, uint32_t *wall, uint32_t *interval)
     return rc;
 }
 
+uint32_t msync_wall_extrapolate(uint32_t wall, uint64_t mono_ts,
+        uint64_t now, uint32_t rate, int32_t ppm)
+{
+    int64_t ticks;
+
+    if (wall == AVS_INVALID_PTS)
+        return wall;
+    ticks = (int64_t)(now - mono_ts) * 9 / 100000 * rate / 1000;
+    ticks += ticks * ppm / 1000000;
+    return wall + (uint32_t)ticks;
+}
+
+const void *msync_session_map_wall(int fd)
+{
+    const struct msync_backend *b = msync_get_backend();
+    void *page;
+
+    if (!b->mmap)
+        return NULL;
+    page = b->mmap(fd, WALL_SNAP_SIZE);
+    if (!page)
+        log_info("session[%d] no wall snapshot, errno:%d", fd, errno);
+    return page;
+}
+
+void msync_session_unmap_wall(const void *page)
+{
+    const struct msync_backend *b = msync_get_backend();
+
+    if (page && b->munmap)
+        b->munmap((void *)page, WALL_SNAP_SIZE);
+}
+
+int msync_session_read_wall(const void *page, uint32_t *wall, uint32_t *interval)
+{
+    const struct wall_snapshot *snap = page;
+    struct wall_snapshot copy;
+    struct timespec now;
+    uint32_t seq;
+    int retry = 4;
+
+    if (!snap)
+        return -1;
+
+    do {
+        seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        copy.flags = __atomic_load_n(&snap->flags, __ATOMIC_RELAXED);
+        copy.wall_clock = __atomic_load_n(&snap->wall_clock, __ATOMIC_RELAXED);
+        copy.rate = __atomic_load_n(&snap->rate, __ATOMIC_RELAXED);
+        copy.ppm = __atomic_load_n(&snap->ppm, __ATOMIC_RELAXED);
+        copy.interval = __atomic_load_n(&snap->interval, __ATOMIC_RELAXED);
+        copy.mono_ts = __atomic_load_n(&snap->mono_ts, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&snap->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    } while (--retry);
+
+    /* writer keeps updating, ask kernel instead */
+    if (!retry)
+        return -1;
+
+    if (!(copy.flags & WALL_SNAP_VALID)) {
+        *wall = AVS_INVALID_PTS;
+    } else if (copy.flags & WALL_SNAP_PAUSED) {
+        *wall = copy.wall_clock;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+        *wall = msync_wall_extrapolate(copy.wall_clock, copy.mono_ts,
+                now.tv_sec * 1000000000LL + now.tv_nsec,
+                copy.rate, copy.ppm);
+    }
+    if (interval)
+        *interval = copy.interval;
+    return 0;
+}
+
 int msync_session_get_pts(int fd, pts90K *p_pts, uint64_t *mono_ts, bool is_video)
 {
     int rc;
     struct pts_tri pts;
 
     if (is_video)
-        rc = ioctl(fd, AMSYNCS_IOC_GET_V_TS, &pts);
+        rc = msync_ioctl(fd, AMSYNCS_IOC_GET_V_TS, &pts);
     else
-        rc = ioctl(fd, AMSYNCS_IOC_GET_A_TS, &pts);
+        rc = msync_ioctl(fd, AMSYNCS_IOC_GET_A_TS, &pts);
 
     if (rc) {
         log_error("session[%d] get ts errno:%d", fd, errno);
@@ -223,7 +521,7 @@ int msync_session_set_audio_start(int fd, pts90K pts, pts90K delay, uint32_t *mo
     start.delay = delay;
     start.mode = 0;
 
-    rc = ioctl(fd, AMSYNCS_IOC_AUDIO_START, &start);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_AUDIO_START, &start);
     if (rc)
         log_error("session[%d] audio start errno:%d", fd, errno);
     else
@@ -248,7 +546,7 @@ int msync_session_set_rate(int fd, float speed)
     int rc;
 
 
-    rc = ioctl(fd, AMSYNCS_IOC_SET_RATE, &krate);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SET_RATE, &krate);
     if (rc)
         log_error("fd[%d] set rate errno:%d", fd, errno);
     return rc;
@@ -260,7 +558,7 @@ int msync_session_get_rate(int fd, float *speed)
     int rc;
 
 
-    rc = ioctl(fd, AMSYNCS_IOC_GET_RATE, &krate);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_GET_RATE, &krate);
     if (rc) {
         log_error("fd[%d] get rate errno:%d", fd, errno);
         return rc;
@@ -273,16 +571,14 @@ int msync_session_set_name(int fd, const char* name)
 {
     int rc;
 
-    rc = ioctl(fd, AMSYNCS_IOC_SET_NAME, name);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SET_NAME, (void *)name);
     if (rc)
         log_error("session[%d] set name errno:%d", fd, errno);
     return rc;
 }
 
-int msync_session_update_vpts(int fd, uint32_t system, uint32_t pts, uint32_t delay)
+void msync_fill_ts(struct pts_tri *ts, uint32_t system, uint32_t pts, uint32_t delay)
 {
-    int rc;
-    struct pts_tri ts;
     struct timespec now;
     uint64_t mono_ns;
 
@@ -290,17 +586,66 @@ int msync_session_update_vpts(int fd, uint32_t system, uint32_t pts, uint32_t de
     mono_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
     mono_ns += delay / 9 * 100000;
 
-    ts.wall_clock = system;
-    ts.pts = pts;
-    ts.delay = delay;
-    ts.mono_ts = mono_ns;
+    ts->wall_clock = system;
+    ts->pts = pts;
+    ts->delay = delay;
+    ts->mono_ts = mono_ns;
+}
+
+int msync_session_set_vts(int fd, const struct pts_tri *ts)
+{
+    int rc;
 
-    rc = ioctl(fd, AMSYNCS_IOC_SET_V_TS, &ts);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SET_V_TS, (void *)ts);
     if (rc)
         log_error("session[%d] set vts errno:%d", fd, errno);
     return rc;
 }
 
+int msync_session_update_vpts(int fd, uint32_t system, uint32_t pts, uint32_t delay)
+{
+    struct pts_tri ts;
+
+    msync_fill_ts(&ts, system, pts, delay);
+    return msync_session_set_vts(fd, &ts);
+}
+
+int msync_session_vsync_txn(int fd, bool *txn_off, const struct pts_tri *vpts,
+        uint32_t *wall, uint32_t *interval, bool *clock_started)
+{
+    int rc;
+    struct vsync_txn txn;
+
+    if (!*txn_off) {
+        memset(&txn, 0, sizeof(txn));
+        if (vpts) {
+            txn.flags |= VSYNC_TXN_VPTS;
+            txn.vpts = *vpts;
+        }
+        rc = msync_ioctl(fd, AMSYNCS_IOC_VSYNC_TXN, &txn);
+        if (!rc) {
+            *wall = txn.wall_clock;
+            if (interval)
+                *interval = txn.interval;
+            if (clock_started)
+                *clock_started = txn.clock_started != 0;
+            return 0;
+        }
+        if (errno != ENOTTY && errno != EINVAL) {
+            log_error("session[%d] vsync txn errno:%d", fd, errno);
+            return rc;
+        }
+        log_info("session[%d] no vsync txn, fall back", fd);
+        *txn_off = true;
+    }
+
+    if (vpts)
+        msync_session_set_vts(fd, vpts);
+    if (clock_started)
+        *clock_started = msync_clock_started(fd);
+    return msync_session_get_wall(fd, wall, interval);
+}
+
 int msync_session_update_apts(int fd, uint32_t system, uint32_t pts, uint32_t delay)
 {
     int rc;
@@ -317,7 +662,7 @@ int msync_session_update_apts(int fd, uint32_t system, uint32_t pts, uint32_t de
     ts.delay = delay;
     ts.mono_ts = mono_ns;
 
-    rc = ioctl(fd, AMSYNCS_IOC_SET_A_TS, &ts);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SET_A_TS, &ts);
     if (rc)
         log_error("session[%d] set ats errno:%d", fd, errno);
     return rc;
@@ -345,7 +690,7 @@ int msync_session_get_stat (int fd,
     memset(&stat, 0, sizeof(stat));
     stat.flag = flag;
     stat.clean_poll = clean_poll;
-    rc = ioctl(fd, AMSYNCS_IOC_GET_SYNC_STAT, &stat);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_GET_SYNC_STAT, &stat);
     if (rc) {
         log_error("fd[%d] get state errno:%d", fd, errno);
         return rc;
@@ -387,7 +732,7 @@ bool msync_clock_started(int fd)
     int rc;
 
 
-    rc = ioctl(fd, AMSYNCS_IOC_GET_CLOCK_START, &start);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_GET_CLOCK_START, &start);
     if (rc)
         log_error("session[%d] set clock start errno:%d", fd, errno);
     return start != 0;
@@ -400,7 +745,7 @@ int msync_session_set_pcr(int fd, pts90K pts, uint64_t mono_clock)
 
     pcr.pts = pts;
     pcr.mono_clock = mono_clock;
-    rc = ioctl(fd, AMSYNCS_IOC_SET_PCR, &pcr);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SET_PCR, &pcr);
     if (rc)
         log_error("session[%d] set pcr.pts %u errno:%d", fd, pcr.pts, errno);
 
@@ -412,7 +757,7 @@ int msync_session_get_pcr(int fd, pts90K *pts, uint64_t *mono_clock)
     int rc;
     struct pcr_pair pcr;
 
-    rc = ioctl(fd, AMSYNCS_IOC_GET_PCR, &pcr);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_GET_PCR, &pcr);
     if (rc)
         log_error("session[%d] get pcr.pts %u errno:%d", fd, pcr.pts, errno);
     else {
@@ -428,7 +773,7 @@ int msync_session_get_debug_mode(int fd, struct session_debug *debug)
 {
     int rc;
 
-    rc = ioctl(fd, AMSYNCS_IOC_GET_DEBUG_MODE, debug);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_GET_DEBUG_MODE, debug);
     if (rc)
         log_error("session[%d] set debug mode errno:%d", fd, errno);
 
@@ -445,7 +790,7 @@ int msync_session_set_clock_dev(int fd, int32_t ppm)
 {
     int rc;
 
-    rc = ioctl(fd, AMSYNCS_IOC_SET_CLK_DEV, &ppm);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SET_CLK_DEV, &ppm);
     if (rc)
         log_error("session[%d] set clk dev errno:%d", fd, errno);
     return rc;
@@ -456,7 +801,7 @@ int msync_session_get_clock_dev(int fd, int32_t *ppm)
     int rc;
     int dev;
 
-    rc = ioctl(fd, AMSYNCS_IOC_GET_CLK_DEV, &dev);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_GET_CLK_DEV, &dev);
     if (rc)
         log_error("session[%d] get clk dev errno:%d", fd, errno);
     else
@@ -468,95 +813,172 @@ int msync_session_set_wall_adj_thres(int fd, int32_t thres)
 {
     int rc;
 
-    rc = ioctl(fd, AMSYNCS_IOC_SET_WALL_ADJ_THRES, &thres);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SET_WALL_ADJ_THRES, &thres);
     if (rc)
         log_error("session[%d] set wall adj thres errno:%d", fd, errno);
     return rc;
 }
 
-static int get_sysfs_uint32(const char *path, uint32_t *value)
-{
+/* sysfs node kept open. Values are not cached, other handles and
+ * processes write the same nodes.
+ */
+struct sysfs_node {
     int fd;
-    char valstr[64];
-    uint32_t val = 0;
-
-    fd = open(path, O_RDONLY);
-    if (fd >= 0) {
-        ssize_t rn = 0;
-        memset(valstr, 0, 64);
-        rn = read(fd, valstr, 64 - 1);
-        if (rn > 0)
-            valstr[strlen(valstr)] = '\0';
-
-        close(fd);
-        if (rn < 0)
-            return -1;
-    } else {
-        log_error("unable to open file %s\n", path);
-        return -1;
+    bool rdonly;
+};
+
+struct session_sysfs {
+    int session_id;
+    struct sysfs_node disc_min;
+    struct sysfs_node disc_max;
+};
+
+static pthread_mutex_t sysfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sysfs_node start_buf_node = { .fd = -1 };
+static struct sysfs_node vout_node = { .fd = -1 };
+static struct sysfs_node demod_node = { .fd = -1 };
+
+static int sysfs_node_open(struct sysfs_node *node, const char *path)
+{
+    const struct msync_backend *b = msync_get_backend();
+
+    if (node->fd >= 0)
+        return 0;
+    node->rdonly = false;
+    node->fd = b->open(path, O_RDWR | O_CLOEXEC);
+    if (node->fd < 0) {
+        node->rdonly = true;
+        node->fd = b->open(path, O_RDONLY | O_CLOEXEC);
     }
-    if (sscanf(valstr, "%u", &val) < 1) {
-        log_error("unable to get pts from: %s", valstr);
+    if (node->fd < 0) {
+        log_error("unable to open file %s", path);
         return -1;
     }
-    *value = val;
     return 0;
 }
 
-int msync_session_get_disc_thres(int session_id, uint32_t *min, uint32_t *max)
+static void sysfs_node_close(struct sysfs_node *node)
 {
-    char name[64];
+    if (node->fd >= 0)
+        msync_get_backend()->close(node->fd);
+    node->fd = -1;
+}
 
-    if (snprintf(name, sizeof(name),
-            "/sys/class/avsync_session%d/disc_thres_min", session_id) < 0)
-        return -1;
-    if (get_sysfs_uint32(name, min))
+static int sysfs_node_read_str(struct sysfs_node *node, char *valstr, int size)
+{
+    ssize_t rn;
+
+    rn = msync_get_backend()->pread(node->fd, valstr, size - 1, 0);
+    if (rn < 0) {
+        log_error("fd %d read errno %d", node->fd, errno);
         return -1;
+    }
+    valstr[rn] = '\0';
+    return 0;
+}
 
-    if (snprintf(name, sizeof(name),
-            "/sys/class/avsync_session%d/disc_thres_max", session_id) < 0)
+static int sysfs_node_read_uint32(struct sysfs_node *node, uint32_t *value)
+{
+    char valstr[16], *end;
+    unsigned long val;
+
+    if (sysfs_node_read_str(node, valstr, sizeof(valstr)))
         return -1;
-    if (get_sysfs_uint32(name, max))
+    val = strtoul(valstr, &end, 10);
+    if (end == valstr) {
+        log_error("unable to get value from: %s", valstr);
         return -1;
-
+    }
+    *value = val;
     return 0;
 }
 
-static int set_sysfs_uint32(const char *path, uint32_t value)
+/* skipped when the node already holds @value, a pread is cheaper
+ * than a store that kicks the driver
+ */
+static int sysfs_node_write_uint32(struct sysfs_node *node, uint32_t value)
 {
-    int fd, ret = 0;
-    char valstr[64];
+    char valstr[16];
+    uint32_t cur;
 
-    fd = open(path, O_RDWR);
-    snprintf(valstr, sizeof(valstr), "%d", value);
-    if (fd >= 0) {
-        ret = write(fd, valstr, strnlen(valstr, sizeof(valstr)));
-        if (ret >= 0)
-            ret = 0;
-        close(fd);
-    } else {
-        log_error("unable to open file %s\n", path);
+    if (!sysfs_node_read_uint32(node, &cur) && cur == value)
+        return 0;
+    if (node->rdonly) {
+        log_error("fd %d read only", node->fd);
+        return -1;
+    }
+    snprintf(valstr, sizeof(valstr), "%u", value);
+    if (msync_get_backend()->pwrite(node->fd, valstr,
+                strnlen(valstr, sizeof(valstr)), 0) < 0) {
+        log_error("fd %d write errno %d", node->fd, errno);
         return -1;
     }
-    return ret;
+    return 0;
 }
 
-int msync_session_set_disc_thres(int session_id, uint32_t min, uint32_t max)
+void* msync_session_sysfs_open(int session_id)
 {
+    struct session_sysfs *sysfs;
     char name[64];
 
-    if (snprintf(name, sizeof(name),
-            "/sys/class/avsync_session%d/disc_thres_min", session_id) < 0)
+    sysfs = (struct session_sysfs *)calloc(1, sizeof(*sysfs));
+    if (!sysfs) {
+        log_error("OOM");
+        return NULL;
+    }
+    sysfs->session_id = session_id;
+    sysfs->disc_min.fd = -1;
+    sysfs->disc_max.fd = -1;
+
+    snprintf(name, sizeof(name),
+            "/sys/class/avsync_session%d/disc_thres_min", session_id);
+    if (sysfs_node_open(&sysfs->disc_min, name))
+        goto err;
+    snprintf(name, sizeof(name),
+            "/sys/class/avsync_session%d/disc_thres_max", session_id);
+    if (sysfs_node_open(&sysfs->disc_max, name))
+        goto err;
+    return sysfs;
+
+err:
+    msync_session_sysfs_close(sysfs);
+    return NULL;
+}
+
+void msync_session_sysfs_close(void *handle)
+{
+    struct session_sysfs *sysfs = handle;
+
+    if (!sysfs)
+        return;
+    sysfs_node_close(&sysfs->disc_min);
+    sysfs_node_close(&sysfs->disc_max);
+    free(sysfs);
+}
+
+int msync_session_get_disc_thres(void *handle, uint32_t *min, uint32_t *max)
+{
+    struct session_sysfs *sysfs = handle;
+
+    if (!sysfs)
+        return -1;
+    if (sysfs_node_read_uint32(&sysfs->disc_min, min))
         return -1;
-    if (set_sysfs_uint32(name, min))
+    if (sysfs_node_read_uint32(&sysfs->disc_max, max))
         return -1;
+    return 0;
+}
 
-    if (snprintf(name, sizeof(name),
-            "/sys/class/avsync_session%d/disc_thres_max", session_id) < 0)
+int msync_session_set_disc_thres(void *handle, uint32_t min, uint32_t max)
+{
+    struct session_sysfs *sysfs = handle;
+
+    if (!sysfs)
         return -1;
-    if (set_sysfs_uint32(name, max))
+    if (sysfs_node_write_uint32(&sysfs->disc_min, min))
+        return -1;
+    if (sysfs_node_write_uint32(&sysfs->disc_max, max))
         return -1;
-
     return 0;
 }
 
@@ -564,7 +986,7 @@ int msync_session_stop_audio(int fd)
 {
     int rc, nouse;
 
-    rc = ioctl(fd, AMSYNCS_IOC_SET_STOP_AUDIO_WAIT, &nouse);
+    rc = msync_ioctl(fd, AMSYNCS_IOC_SET_STOP_AUDIO_WAIT, &nouse);
     if (rc)
         log_error("session[%d] set stop audio errno:%d", fd, errno);
     return rc;
@@ -572,29 +994,77 @@ int msync_session_stop_audio(int fd)
 
 int msync_session_set_start_thres(int fd, uint32_t thres)
 {
-    if (set_sysfs_uint32("/sys/class/aml_msync/start_buf_thres", thres * 90))
-        return -1;
-    return 0;
+    int rc = -1;
+
+    pthread_mutex_lock(&sysfs_lock);
+    if (!sysfs_node_open(&start_buf_node, "/sys/class/aml_msync/start_buf_thres"))
+        rc = sysfs_node_write_uint32(&start_buf_node, thres * 90);
+    pthread_mutex_unlock(&sysfs_lock);
+    return rc;
 }
 
 int msync_session_get_vsync_interval(int32_t *p)
 {
-    FILE *fd;
-    int den, num, inter;
-    int ret = -1;
+    char valstr[64];
+    int den, num, inter, rc = -1;
 
-    fd = fopen(VOUT_MODE_DEV, "r");
-    if (!fd) {
-        log_error("unable to open file %s\n", VOUT_MODE_DEV);
+    /* output mode may change, read it every time */
+    pthread_mutex_lock(&sysfs_lock);
+    if (!sysfs_node_open(&vout_node, VOUT_MODE_DEV))
+        rc = sysfs_node_read_str(&vout_node, valstr, sizeof(valstr));
+    pthread_mutex_unlock(&sysfs_lock);
+    if (rc)
         return -1;
-    }
 
-    if (fscanf(fd, "den %d num %d inc %d\n", &den, &num, &inter) == 3) {
-        *p  = inter;
-        ret = 0;
-    }
+    if (sscanf(valstr, "den %d num %d inc %d\n", &den, &num, &inter) != 3)
+        return -1;
 
-    fclose(fd);
-    return ret;
+    *p  = inter;
+    return 0;
 }
 
+#define DEMOD_NODE "/sys/class/dtvdemod/atsc_para"
+#define DEMOD_SFO_CMD "5"
+#define DEMOD_LOCKED 0x1f
+
+int msync_demod_get_sfo(int32_t *ppm)
+{
+    const struct msync_backend *b = msync_get_backend();
+    char buf[128];
+    uint32_t reg_v, lock;
+    ssize_t rn;
+    float val;
+
+    pthread_mutex_lock(&sysfs_lock);
+    if (demod_node.fd < 0 &&
+            (demod_node.fd = b->open(DEMOD_NODE, O_RDWR | O_CLOEXEC)) < 0) {
+        pthread_mutex_unlock(&sysfs_lock);
+        log_warn("node not found %s", DEMOD_NODE);
+        return -2;
+    }
+    /* select the SFO register, then read it back */
+    if (b->pwrite(demod_node.fd, DEMOD_SFO_CMD,
+                sizeof(DEMOD_SFO_CMD) - 1, 0) < 0) {
+        log_error("demod write errno %d", errno);
+        rn = -1;
+    } else {
+        rn = b->pread(demod_node.fd, buf, sizeof(buf) - 1, 0);
+    }
+    pthread_mutex_unlock(&sysfs_lock);
+    if (rn <= 0) {
+        log_error("read error");
+        return -1;
+    }
+    buf[rn] = 0;
+    if (sscanf(buf, "ck=0x%x lock=%d", &reg_v, &lock) != 2) {
+        log_error("wrong format %s", buf);
+        return -1;
+    }
+    if (lock != DEMOD_LOCKED)
+        return 1;
+    if (reg_v > ((2 << 20) - 1))
+        reg_v -= (2 << 21);
+    val = reg_v * 10.762238f / 12 * 1000000 / (2 << 25);
+    *ppm = val;
+    return 0;
+}
@@ -22,6 +22,8 @@
 #ifndef MSYNC_UTIL_H
 #define MSYNC_UTIL_H
 
+#include <poll.h>
+#include <sys/epoll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include "aml_avsync.h"
@@ -39,6 +41,19 @@ enum internal_sync_stat {
 
 int msync_create_session();
 void msync_destory_session(int id);
+int msync_alloc_session(int fd, int *id);
+
+int msync_session_open(int session_id);
+/* open, waiting up to @timeout ms for the device node to show up */
+int msync_session_open_wait(int session_id, int timeout);
+void msync_session_close(int fd);
+int msync_session_poll(struct pollfd *fds, int nfds, int timeout);
+/* epoll bit for mode change of session fd, and epoll_wait that keeps
+ * the backend running
+ */
+uint32_t msync_session_notify_events(void);
+int msync_session_epoll_wait(int epfd, struct epoll_event *events,
+        int maxevents, int timeout);
 
 int msync_session_set_mode(int fd, enum sync_mode mode);
 int msync_session_get_mode(int fd, enum sync_mode *mode);
@@ -48,6 +63,13 @@ int msync_session_set_pause(int fd, bool pause);
 int msync_session_set_video_start(int fd, pts90K pts);
 int msync_session_get_pts(int fd, pts90K *p_pts, uint64_t *mono_ts, bool is_video);
 int msync_session_get_wall(int fd, uint32_t *wall, uint32_t *interval);
+/* shared wall snapshot, NULL when the driver does not provide it */
+const void *msync_session_map_wall(int fd);
+void msync_session_unmap_wall(const void *page);
+/* lock-free wall read from snapshot, non-zero means fall back to ioctl */
+int msync_session_read_wall(const void *page, uint32_t *wall, uint32_t *interval);
+uint32_t msync_wall_extrapolate(uint32_t wall, uint64_t mono_ts,
+        uint64_t now, uint32_t rate, int32_t ppm);
 int msync_session_set_video_start(int fd, pts90K pts);
 int msync_session_set_audio_start(int fd, pts90K pts, pts90K delay, uint32_t *mode);
 int msync_session_set_video_dis(int fd, pts90K pts);
@@ -56,6 +78,14 @@ int msync_session_set_rate(int fd, float speed);
 int msync_session_get_rate(int fd, float *speed);
 int msync_session_set_name(int fd, const char* name);
 int msync_session_update_vpts(int fd, uint32_t system, uint32_t pts, uint32_t delay);
+void msync_fill_ts(struct pts_tri *ts, uint32_t system, uint32_t pts, uint32_t delay);
+int msync_session_set_vts(int fd, const struct pts_tri *ts);
+/* report vpts of previous vsync (NULL for none) and read wall in one
+ * ioctl, falls back to separate ones on old drivers.
+ * @txn_off: per fd, false at first, set once the driver rejects it
+ */
+int msync_session_vsync_txn(int fd, bool *txn_off, const struct pts_tri *vpts,
+        uint32_t *wall, uint32_t *interval, bool *clock_started);
 int msync_session_update_apts(int fd, uint32_t system, uint32_t pts, uint32_t delay);
 int msync_session_set_audio_stop(int fd);
 int msync_session_set_video_stop(int fd);
@@ -72,9 +102,18 @@ int msync_session_set_audio_switch(int fd, bool start);
 int msync_session_get_clock_dev(int fd, int32_t *ppm);
 int msync_session_set_clock_dev(int fd, int32_t ppm);
 int msync_session_set_wall_adj_thres(int fd, int32_t thres);
-int msync_session_get_disc_thres(int session_id, uint32_t *min, uint32_t *max);
-int msync_session_set_disc_thres(int session_id, uint32_t min, uint32_t max);
+/* per handle sysfs nodes of session @session_id, kept open */
+void* msync_session_sysfs_open(int session_id);
+void msync_session_sysfs_close(void *sysfs);
+int msync_session_get_disc_thres(void *sysfs, uint32_t *min, uint32_t *max);
+/* nodes already holding the value are not written */
+int msync_session_set_disc_thres(void *sysfs, uint32_t min, uint32_t max);
 int msync_session_stop_audio(int fd);
 int msync_session_set_start_thres(int fd, uint32_t thres);
 int msync_session_get_vsync_interval(int32_t *p);
+/* ppm between demod and PCR clock from demod SFO, node kept open.
+ * Return 0 with @ppm, 1 if demod not locked, -2 without demod,
+ * -1 on other errors
+ */
+int msync_demod_get_sfo(int32_t *ppm);
 #endif
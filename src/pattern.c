@@ -64,6 +64,8 @@ typedef void (* reset_pattern_func)(void *handle);
 
 struct pdetector {
     void *priv;
+    /* struct pattern_detector_ex for 100Hz+ */
+    bool ex;
 
     correct_pattern_func correct_pattern_f;
     detect_pattern_func detect_pattern_f;
@@ -588,6 +590,7 @@ void* create_pattern_detector(int vsync_interval)
         }
         pd->detected = -1;
         p->priv = pd;
+        p->ex = true;
         p->detect_pattern_f = detect_pattern_ex_all;
         p->correct_pattern_f = correct_pattern_ex;
         p->reset_pattern_f = reset_pattern_ex;
@@ -599,6 +602,27 @@ error:
     return NULL;
 }
 
+int recycle_pattern_detector(void *handle, int vsync_interval)
+{
+    struct pdetector *p = (struct pdetector *)handle;
+
+    if (!p || p->ex != (vsync_interval <= 900))
+        return -1;
+
+    if (p->ex) {
+        struct pattern_detector_ex *pd = p->priv;
+
+        memset(pd, 0, sizeof(*pd));
+        pd->detected = -1;
+    } else {
+        struct pattern_detector *pd = p->priv;
+
+        memset(pd, 0, sizeof(*pd));
+        pd->detected = -1;
+    }
+    return 0;
+}
+
 void destroy_pattern_detector(void *handle)
 {
     struct pdetector *p = (struct pdetector *)handle;
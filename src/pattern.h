@@ -23,6 +23,10 @@
 
 void* create_pattern_detector(int vsync_interval);
 void destroy_pattern_detector(void *handle);
+/* back to a freshly created state, -1 if @vsync_interval needs
+ * a new detector
+ */
+int recycle_pattern_detector(void *handle, int vsync_interval);
 void reset_pattern(void *handle);
 bool detect_pattern(void* handle, int cur_period, int last_period);
 void correct_pattern(void* handle, pts90K fpts, pts90K npts,
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: binary capture of PCR samples. Records go through stdio
+ * buffering, the PCR thread only hits the file every few seconds.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "aml_avsync_log.h"
+#include "pcr_capture.h"
+
+#define PCR_CAPTURE_BUF_SIZE (16*1024)
+
+struct pcr_capture {
+    FILE *fp;
+    uint32_t num;
+    char path[128];
+    char buf[PCR_CAPTURE_BUF_SIZE];
+};
+
+static int capture_index;
+
+void* pcr_capture_open(void)
+{
+    const char *prefix = getenv("AML_AVSYNC_PCR_CAPTURE");
+    struct pcr_capture_header header;
+    struct pcr_capture *capture;
+
+    if (!prefix || !prefix[0])
+        return NULL;
+
+    capture = calloc(1, sizeof(*capture));
+    if (!capture)
+        return NULL;
+    snprintf(capture->path, sizeof(capture->path), "%s%d_%d.pcr",
+            prefix, getpid(), __atomic_fetch_add(&capture_index, 1,
+                __ATOMIC_RELAXED));
+    capture->fp = fopen(capture->path, "wbe");
+    if (!capture->fp) {
+        log_error("open %s errno %d", capture->path, errno);
+        free(capture);
+        return NULL;
+    }
+    setvbuf(capture->fp, capture->buf, _IOFBF, sizeof(capture->buf));
+
+    memset(&header, 0, sizeof(header));
+    header.magic = PCR_CAPTURE_MAGIC;
+    header.version = PCR_CAPTURE_VERSION;
+    header.record_size = sizeof(struct pcr_capture_record);
+    fwrite(&header, sizeof(header), 1, capture->fp);
+    log_info("capture to %s", capture->path);
+    return capture;
+}
+
+void pcr_capture_write(void *handle, const struct pcr_info *pcr)
+{
+    struct pcr_capture *capture = handle;
+    struct pcr_capture_record rec;
+
+    if (!capture)
+        return;
+    rec.monoclk = pcr->monoclk;
+    rec.pts = pcr->pts;
+    if (fwrite(&rec, sizeof(rec), 1, capture->fp) == 1)
+        capture->num++;
+}
+
+void pcr_capture_close(void *handle)
+{
+    struct pcr_capture *capture = handle;
+
+    if (!capture)
+        return;
+    fclose(capture->fp);
+    log_info("%s: %u samples", capture->path, capture->num);
+    free(capture);
+}
+
+static int trace_add(struct pcr_info **trace, int *num, int *cap,
+        long long monoclk, long long pts)
+{
+    if (*num == *cap) {
+        struct pcr_info *t;
+
+        *cap = *cap ? *cap * 2 : 4096;
+        t = realloc(*trace, *cap * sizeof(**trace));
+        if (!t)
+            return -1;
+        *trace = t;
+    }
+    (*trace)[*num].monoclk = monoclk;
+    (*trace)[*num].pts = pts;
+    (*num)++;
+    return 0;
+}
+
+int pcr_capture_load(const char *path, struct pcr_info **trace, int *num)
+{
+    struct pcr_capture_header header;
+    struct pcr_capture_record rec;
+    long long monoclk, pts;
+    char line[128];
+    int cap = 0, rc = 0;
+    FILE *fp;
+
+    if (!path || !trace || !num)
+        return -1;
+    *trace = NULL;
+    *num = 0;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        log_error("open %s errno %d", path, errno);
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, fp) == 1 &&
+            header.magic == PCR_CAPTURE_MAGIC) {
+        if (header.record_size < sizeof(rec)) {
+            log_error("%s: record size %u", path, header.record_size);
+            rc = -1;
+            goto exit;
+        }
+        while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+            if (header.record_size > sizeof(rec) &&
+                    fseek(fp, header.record_size - sizeof(rec), SEEK_CUR))
+                break;
+            if (trace_add(trace, num, &cap, rec.monoclk, rec.pts)) {
+                rc = -1;
+                goto exit;
+            }
+        }
+    } else {
+        rewind(fp);
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "%lld, %lld", &monoclk, &pts) != 2)
+                continue;
+            if (trace_add(trace, num, &cap, monoclk, pts)) {
+                rc = -1;
+                goto exit;
+            }
+        }
+    }
+
+exit:
+    fclose(fp);
+    if (rc) {
+        free(*trace);
+        *trace = NULL;
+        *num = 0;
+    }
+    return rc;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: binary capture of the PCR samples fed to pcr_monitor,
+ * for offline replay through the estimators.
+ * A capture is one header and fixed size records, host byte order.
+ * Set AML_AVSYNC_PCR_CAPTURE to a path prefix and every PCR monitor
+ * writes <prefix><pid>_<n>.pcr until it is recycled or destroyed.
+ */
+#ifndef AML_AVSYNC_PCR_CAPTURE_H
+#define AML_AVSYNC_PCR_CAPTURE_H
+
+#include <stdint.h>
+#include "pcr_monitor.h"
+
+#define PCR_CAPTURE_MAGIC 0x43524350 /* "PCRC" */
+#define PCR_CAPTURE_VERSION 1
+
+struct pcr_capture_header {
+    uint32_t magic;
+    uint16_t version;
+    /* sizeof(struct pcr_capture_record), records may grow */
+    uint16_t record_size;
+    uint32_t reserved[2];
+};
+
+struct pcr_capture_record {
+    /* both in us, as given to pcr_monitor_process */
+    int64_t monoclk;
+    int64_t pts;
+};
+
+/* NULL when AML_AVSYNC_PCR_CAPTURE is not set or the file can not be
+ * created
+ */
+void* pcr_capture_open(void);
+void pcr_capture_write(void *capture, const struct pcr_info *pcr);
+void pcr_capture_close(void *capture);
+
+/* Read a whole capture, or a text trace of "monoclk, pts" lines as
+ * written by older versions.
+ * Params:
+ *   @path: capture file
+ *   @trace: samples, free() by caller
+ *   @num: number of samples
+ * Return:
+ *   0 for OK, or error code
+ */
+int pcr_capture_load(const char *path, struct pcr_info **trace, int *num);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: clock recovery algorithms behind pcr_monitor.
+ * Every estimator reports through the same status/deviation contract,
+ * deviation is (PCR rate - monotonic rate) in ppm.
+ */
+#ifndef AML_AVSYNC_PCR_ESTIMATOR_H
+#define AML_AVSYNC_PCR_ESTIMATOR_H
+
+#include "pcr_monitor.h"
+
+struct pcr_estimator {
+    const char *name;
+    void* (*create)(void);
+    void (*destroy)(void *priv);
+    /* drop all history, as if just created */
+    void (*reset)(void *priv);
+    int (*process)(void *priv, struct pcr_info *pcr);
+    enum pcr_monitor_status (*get_status)(void *priv);
+    /* only valid from DEVIATION_READY on */
+    int (*get_deviation)(void *priv, int *ppm);
+    /* optional, 95% half width of the deviation in ppm */
+    int (*get_confidence)(void *priv, int *ci_ppm);
+};
+
+/* 1000 sample groups, probe and wait for stable group deviation */
+extern const struct pcr_estimator pcr_group_estimator;
+/* streaming least squares, constant memory */
+extern const struct pcr_estimator pcr_lsq_estimator;
+/* Kalman filter, first deviation within seconds then refined */
+extern const struct pcr_estimator pcr_kalman_estimator;
+
+#endif
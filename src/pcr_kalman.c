@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: Kalman filter clock recovery.
+ * Two states, offset = pts - monoclk in us and its rate, the deviation.
+ * The rate is modelled as a slow random walk so the filter keeps
+ * tracking crystal drift. Measurement noise (PCR jitter) is learnt from
+ * second differences of the offset, which cancel any linear drift and do
+ * not depend on the filter's own covariance.
+ * The rate variance gives the confidence interval, a first deviation is
+ * reported as soon as it is narrow enough and then refined while it
+ * keeps shrinking. A run of samples off the prediction that agree with
+ * each other is a discontinuity, the offset is rebased by their mean
+ * innovation and the rate kept.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aml_avsync_log.h"
+#include "pcr_estimator.h"
+
+#define PCR_MODULE_NAME "[PCR_KALMAN]"
+#define log_kf_info(fmt, ...)  log_info(PCR_MODULE_NAME#fmt, ##__VA_ARGS__)
+
+#define PPM_SCALE (1000*1000)
+/* prior: 1ms jitter, rate within 100ppm */
+#define KF_R_INIT (1000.0 * 1000.0)
+#define KF_R_MIN (10.0 * 10.0)
+#define KF_RATE_SIGMA_INIT (100e-6)
+/* rate random walk, about 1ppm per 100s; offset wander 10us per s */
+#define KF_Q_RATE (1e-20)
+#define KF_Q_OFFSET (1e-4)
+/* jitter is a plain mean first, then a running one */
+#define KF_R_WINDOW (64)
+#define KF_MIN_SAMPLES (16)
+#define KF_MIN_SPAN_US (1000*1000)
+/* 95% half width of the rate to report and to reach long term */
+#define KF_READY_CI_PPM (10.0)
+#define KF_LONG_TERM_CI_PPM (4.0)
+#define KF_STEP_PPM (1.0)
+/* innovation gate, in sigma and never tighter than the floor */
+#define KF_GATE_SIGMA (4.0)
+#define KF_GATE_FLOOR_US (2*1000)
+#define KF_BIAS_MAX_US (30*1000)
+#define KF_OUTLIER_RESET (32)
+
+struct kf_state {
+    enum pcr_monitor_status status;
+    /* origin, first sample */
+    long long x0;
+    long long d0;
+    long long last_x;
+    uint32_t n;
+    /* offset in us and rate */
+    double off;
+    double rate;
+    /* covariance */
+    double p00;
+    double p01;
+    double p11;
+    /* measurement noise and the offsets it is learnt from */
+    double r;
+    double r_est;
+    double z1;
+    double z2;
+    uint32_t r_cnt;
+    uint32_t outlier_run;
+    /* innovations of the run, a rebase needs them to agree */
+    double run_sum;
+    double run_sq;
+    uint32_t outlier_cnt;
+    uint32_t rebase_cnt;
+    int deviation;
+    int ci;
+};
+
+static void kf_reset(void *priv)
+{
+    struct kf_state *s = priv;
+
+    memset(s, 0, sizeof(*s));
+    s->status = RECORDING;
+    s->r = KF_R_INIT;
+    s->p00 = KF_R_INIT;
+    s->p11 = KF_RATE_SIGMA_INIT * KF_RATE_SIGMA_INIT;
+}
+
+static void* kf_create(void)
+{
+    struct kf_state *s;
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+    kf_reset(s);
+    return s;
+}
+
+static void kf_destroy(void *priv)
+{
+    free(priv);
+}
+
+static void kf_update_status(struct kf_state *s, long long span)
+{
+    double rate = s->rate * PPM_SCALE;
+    double ci = 1.96 * sqrt(s->p11) * PPM_SCALE;
+    double step;
+
+    s->ci = ceil(ci);
+    if (s->n < KF_MIN_SAMPLES || span < KF_MIN_SPAN_US)
+        return;
+    if (s->status < DEVIATION_READY) {
+        if (ci > KF_READY_CI_PPM) {
+            s->status = WAIT_DEVIATION_STABLE;
+            return;
+        }
+        s->deviation = lround(rate);
+        s->status = DEVIATION_READY;
+        log_kf_info("ready deviation %d +/- %d n %u span %lld ms outlier %u",
+            s->deviation, s->ci, s->n, span / 1000, s->outlier_cnt);
+        return;
+    }
+    /* big steps early, finer as the interval narrows */
+    step = ci / 2 > KF_STEP_PPM ? ci / 2 : KF_STEP_PPM;
+    if (fabs(rate - s->deviation) > step) {
+        log_kf_info("deviation %d -> %ld +/- %d",
+            s->deviation, lround(rate), s->ci);
+        s->deviation = lround(rate);
+    }
+    if (s->status == DEVIATION_READY && ci <= KF_LONG_TERM_CI_PPM)
+        s->status = DEVIATION_LONG_TERM_READY;
+}
+
+static int kf_process(void *priv, struct pcr_info *pcr)
+{
+    struct kf_state *s = priv;
+    double dt, z, y, sy, gate, k0, k1, mean, sd;
+    double p00, p01, p11;
+
+    if (!s->n) {
+        s->x0 = s->last_x = pcr->monoclk;
+        s->d0 = pcr->pts - pcr->monoclk;
+        s->n++;
+        return 0;
+    }
+    if (pcr->monoclk <= s->last_x)
+        return 0;
+
+    /* predict */
+    dt = pcr->monoclk - s->last_x;
+    p00 = s->p00 + dt * (2 * s->p01 + dt * s->p11) +
+        KF_Q_RATE * dt * dt * dt / 3 + KF_Q_OFFSET * dt;
+    p01 = s->p01 + dt * s->p11 + KF_Q_RATE * dt * dt / 2;
+    p11 = s->p11 + KF_Q_RATE * dt;
+
+    z = pcr->pts - pcr->monoclk - s->d0;
+    y = z - (s->off + s->rate * dt);
+    sy = p00 + s->r;
+
+    if (s->n < KF_MIN_SAMPLES) {
+        gate = KF_BIAS_MAX_US;
+    } else {
+        gate = KF_GATE_SIGMA * sqrt(sy);
+        if (gate < KF_GATE_FLOOR_US)
+            gate = KF_GATE_FLOOR_US;
+    }
+    if (fabs(y) > gate) {
+        s->outlier_cnt++;
+        if (!s->outlier_run)
+            s->run_sum = s->run_sq = 0;
+        s->run_sum += y;
+        s->run_sq += y * y;
+        if (++s->outlier_run < KF_OUTLIER_RESET)
+            return 0;
+        if (s->n < KF_MIN_SAMPLES) {
+            log_kf_info("unstable start, innovation %.0f us, restart", y);
+            kf_reset(s);
+            return kf_process(s, pcr);
+        }
+        mean = s->run_sum / s->outlier_run;
+        sd = sqrt(fmax(s->run_sq / s->outlier_run - mean * mean, 0));
+        if (sd > gate / 2) {
+            /* not one new segment, keep dropping */
+            log_kf_info("outlier run mean %.0f sd %.0f us, no rebase",
+                mean, sd);
+            s->outlier_run = 0;
+            return 0;
+        }
+        /* splice or wrap, keep the rate and move the new segment onto it,
+         * by the mean of the run so no one sample's jitter is kept
+         */
+        s->d0 += llround(mean);
+        s->rebase_cnt++;
+        log_kf_info("discontinuity %.0f us sd %.0f, rebase %u",
+            mean, sd, s->rebase_cnt);
+        z -= llround(mean);
+        y -= llround(mean);
+    }
+    s->outlier_run = 0;
+
+    /* update */
+    k0 = p00 / sy;
+    k1 = p01 / sy;
+    s->off += s->rate * dt + k0 * y;
+    s->rate += k1 * y;
+    s->p00 = (1 - k0) * p00;
+    s->p01 = (1 - k0) * p01;
+    s->p11 = p11 - k1 * p01;
+    s->last_x = pcr->monoclk;
+    s->n++;
+
+    /* white jitter of variance R gives second differences of 6R */
+    if (s->n >= 3) {
+        y = z - 2 * s->z1 + s->z2;
+        s->r_cnt++;
+        s->r_est += (y * y / 6 - s->r_est) /
+            (s->r_cnt < KF_R_WINDOW ? s->r_cnt : KF_R_WINDOW);
+        /* keep the prior until the estimate means something */
+        if (s->r_cnt >= KF_MIN_SAMPLES)
+            s->r = s->r_est > KF_R_MIN ? s->r_est : KF_R_MIN;
+    }
+    s->z2 = s->z1;
+    s->z1 = z;
+
+    kf_update_status(s, pcr->monoclk - s->x0);
+    return 0;
+}
+
+static enum pcr_monitor_status kf_get_status(void *priv)
+{
+    struct kf_state *s = priv;
+
+    return s->status;
+}
+
+static int kf_get_deviation(void *priv, int *ppm)
+{
+    struct kf_state *s = priv;
+
+    if (s->status < DEVIATION_READY) {
+        *ppm = 0;
+        return -1;
+    }
+    *ppm = s->deviation;
+    return 0;
+}
+
+static int kf_get_confidence(void *priv, int *ci_ppm)
+{
+    struct kf_state *s = priv;
+
+    if (s->n < KF_MIN_SAMPLES)
+        return -1;
+    *ci_ppm = s->ci;
+    return 0;
+}
+
+const struct pcr_estimator pcr_kalman_estimator = {
+    .name = "kalman",
+    .create = kf_create,
+    .destroy = kf_destroy,
+    .reset = kf_reset,
+    .process = kf_process,
+    .get_status = kf_get_status,
+    .get_deviation = kf_get_deviation,
+    .get_confidence = kf_get_confidence,
+};
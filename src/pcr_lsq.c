@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: streaming least squares clock recovery.
+ * Fits offset = pts - monoclk against monoclk, the slope is the deviation.
+ * Weighted running moments with exponential forgetting keep the state
+ * constant and the work per sample O(1). Samples far off the fitted line,
+ * compared with the running residual RMS, are dropped. A run of them
+ * that agree with each other is a stream discontinuity, the offset is
+ * rebased by their mean residual and the slope kept.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aml_avsync_log.h"
+#include "pcr_estimator.h"
+
+#define PCR_MODULE_NAME "[PCR_LSQ]"
+#define log_lsq_info(fmt, ...)  log_info(PCR_MODULE_NAME#fmt, ##__VA_ARGS__)
+
+#define PPM_SCALE (1000*1000)
+/* forgetting factor 1 - 1/4096, about 160s of PCR at 25Hz */
+#define LSQ_WINDOW (4096)
+#define LSQ_MIN_SAMPLES (64)
+#define LSQ_MIN_SPAN_US (5*1000*1000)
+#define LSQ_LONG_TERM_SPAN_US (120*1000*1000)
+/* standard error of the slope to report a deviation */
+#define LSQ_READY_SE_PPM (2.0)
+/* reported deviation follows the fit beyond this */
+#define LSQ_HYSTERESIS_PPM (1.0)
+/* residual filter, K times RMS but never tighter than the floor */
+#define LSQ_OUTLIER_K (4.0)
+#define LSQ_OUTLIER_FLOOR_US (2*1000)
+/* before the fit settles, same bias limit as the group estimator */
+#define LSQ_BIAS_MAX_US (30*1000)
+#define LSQ_OUTLIER_RESET (32)
+
+struct lsq_state {
+    enum pcr_monitor_status status;
+    /* origin, first sample of the fit */
+    long long x0;
+    long long d0;
+    long long last_x;
+    uint32_t n;
+    /* weighted means and co-moments, relative to origin */
+    double w;
+    double mx;
+    double md;
+    double sxx;
+    double sxd;
+    /* running mean of squared residuals */
+    double r2;
+    uint32_t outlier_run;
+    /* residuals of the run, a rebase needs them to agree */
+    double run_sum;
+    double run_sq;
+    uint32_t outlier_cnt;
+    uint32_t rebase_cnt;
+    int deviation;
+    int ci;
+};
+
+static void lsq_reset(void *priv)
+{
+    struct lsq_state *s = priv;
+
+    memset(s, 0, sizeof(*s));
+    s->status = RECORDING;
+}
+
+static void* lsq_create(void)
+{
+    struct lsq_state *s;
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+    lsq_reset(s);
+    return s;
+}
+
+static void lsq_destroy(void *priv)
+{
+    free(priv);
+}
+
+static void lsq_update_status(struct lsq_state *s, double x)
+{
+    double slope, se;
+
+    if (s->n < LSQ_MIN_SAMPLES || x < LSQ_MIN_SPAN_US || s->sxx <= 0)
+        return;
+
+    slope = s->sxd / s->sxx * PPM_SCALE;
+    se = sqrt(s->r2 / s->sxx) * PPM_SCALE;
+    s->ci = ceil(1.96 * se);
+    if (s->status < DEVIATION_READY) {
+        if (se >= LSQ_READY_SE_PPM) {
+            s->status = WAIT_DEVIATION_STABLE;
+            return;
+        }
+        s->deviation = lround(slope);
+        s->status = DEVIATION_READY;
+        log_lsq_info("ready deviation %d se %.2f n %u span %lld ms outlier %u",
+            s->deviation, se, s->n, (long long)x / 1000, s->outlier_cnt);
+    } else if (fabs(slope - s->deviation) > LSQ_HYSTERESIS_PPM) {
+        log_lsq_info("deviation %d -> %ld se %.2f",
+            s->deviation, lround(slope), se);
+        s->deviation = lround(slope);
+    }
+    if (s->status == DEVIATION_READY && x >= LSQ_LONG_TERM_SPAN_US)
+        s->status = DEVIATION_LONG_TERM_READY;
+}
+
+static int lsq_process(void *priv, struct pcr_info *pcr)
+{
+    struct lsq_state *s = priv;
+    const double lambda = 1.0 - 1.0 / LSQ_WINDOW;
+    double x, d, dx, r, thres, mean, sd;
+
+    if (!s->n) {
+        s->x0 = pcr->monoclk;
+        s->d0 = pcr->pts - pcr->monoclk;
+    } else if (pcr->monoclk <= s->last_x) {
+        return 0;
+    }
+    x = pcr->monoclk - s->x0;
+    d = pcr->pts - pcr->monoclk - s->d0;
+
+    if (s->n >= 2 && s->sxx > 0) {
+        r = d - (s->md + s->sxd / s->sxx * (x - s->mx));
+        if (s->n < LSQ_MIN_SAMPLES) {
+            thres = LSQ_BIAS_MAX_US;
+        } else {
+            thres = LSQ_OUTLIER_K * sqrt(s->r2);
+            if (thres < LSQ_OUTLIER_FLOOR_US)
+                thres = LSQ_OUTLIER_FLOOR_US;
+        }
+        if (fabs(r) > thres) {
+            s->outlier_cnt++;
+            if (!s->outlier_run)
+                s->run_sum = s->run_sq = 0;
+            s->run_sum += r;
+            s->run_sq += r * r;
+            if (++s->outlier_run < LSQ_OUTLIER_RESET)
+                return 0;
+            if (s->n < LSQ_MIN_SAMPLES) {
+                log_lsq_info("unstable start, residual %.0f us, restart", r);
+                lsq_reset(s);
+                return lsq_process(s, pcr);
+            }
+            mean = s->run_sum / s->outlier_run;
+            sd = sqrt(fmax(s->run_sq / s->outlier_run - mean * mean, 0));
+            if (sd > thres / 2) {
+                /* not one new segment, keep dropping */
+                log_lsq_info("outlier run mean %.0f sd %.0f us, no rebase",
+                    mean, sd);
+                s->outlier_run = 0;
+                return 0;
+            }
+            /* splice or wrap, keep the fit and move the new segment onto
+             * it. One residual would carry its jitter into every sample
+             * after, the mean of the run does not.
+             */
+            s->d0 += llround(mean);
+            s->rebase_cnt++;
+            log_lsq_info("discontinuity %.0f us sd %.0f, rebase %u",
+                mean, sd, s->rebase_cnt);
+            d -= llround(mean);
+            r -= llround(mean);
+        }
+        s->outlier_run = 0;
+        s->r2 += (r * r - s->r2) / (s->n < LSQ_WINDOW ? s->n : LSQ_WINDOW);
+    }
+
+    s->w = lambda * s->w + 1;
+    dx = x - s->mx;
+    s->mx += dx / s->w;
+    s->md += (d - s->md) / s->w;
+    s->sxx = lambda * s->sxx + dx * (x - s->mx);
+    s->sxd = lambda * s->sxd + dx * (d - s->md);
+    s->last_x = pcr->monoclk;
+    s->n++;
+
+    lsq_update_status(s, x);
+    return 0;
+}
+
+static enum pcr_monitor_status lsq_get_status(void *priv)
+{
+    struct lsq_state *s = priv;
+
+    return s->status;
+}
+
+static int lsq_get_deviation(void *priv, int *ppm)
+{
+    struct lsq_state *s = priv;
+
+    if (s->status < DEVIATION_READY) {
+        *ppm = 0;
+        return -1;
+    }
+    *ppm = s->deviation;
+    return 0;
+}
+
+static int lsq_get_confidence(void *priv, int *ci_ppm)
+{
+    struct lsq_state *s = priv;
+
+    if (s->status < WAIT_DEVIATION_STABLE)
+        return -1;
+    *ci_ppm = s->ci;
+    return 0;
+}
+
+const struct pcr_estimator pcr_lsq_estimator = {
+    .name = "lsq",
+    .create = lsq_create,
+    .destroy = lsq_destroy,
+    .reset = lsq_reset,
+    .process = lsq_process,
+    .get_status = lsq_get_status,
+    .get_deviation = lsq_get_deviation,
+    .get_confidence = lsq_get_confidence,
+};
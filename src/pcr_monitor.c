@@ -14,12 +14,14 @@
  * limitations under the License.
  */
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
 #include "aml_avsync_log.h"
-#include "pcr_monitor.h"
+#include "pcr_capture.h"
+#include "pcr_estimator.h"
 
 #define PCR_MODULE_NAME "[PCR_MONITOR]"
 #define log_pcr_trace(fmt, ...) log_trace(PCR_MODULE_NAME#fmt, ##__VA_ARGS__)
@@ -42,9 +44,48 @@
 #define RECORD_BIAS_MAX (30*1000)
 #define WAIT_DEVIATION_STABLE_COUNT (10)
 #define WAIT_DEVIATION_RANGE (20)
-#define MONITOR_PCR_BIG_GAP (60*1000*1000) //60s
 #define SKIP_START_GROUP_NUM (3)
-//#define DUMP_TO_FILE
+#define GROUP_VALID_MIN (980)
+/* Rejections in a row with the same bias. Against a group's first few
+ * samples they outvote them, against an established offset they are a
+ * discontinuity (splice, PCR wrap) and the timeline is rebased.
+ */
+#define GROUP_RESEED_RUN (8)
+/* biases of the run must agree this well to be one new segment, all
+ * but one of them, a late sample in the run does not void it
+ */
+#define GROUP_RUN_SPREAD_MAX (4*1000)
+
+#ifdef PCR_FIXED_POINT
+/* x / n is x * ceil(2^36 / n) >> 36, exact while |x| < n << 16 and
+ * n <= 1024 (error below 1/n), and no product overflows 64 bits
+ */
+#define RECIP_SHIFT (36)
+#define RECIP_X_BITS (16)
+static uint64_t recip[CLOCK_RECORD_NUM + 1];
+static pthread_once_t recip_once = PTHREAD_ONCE_INIT;
+
+static void recip_init(void)
+{
+    int n;
+
+    for (n = 1; n <= CLOCK_RECORD_NUM; n++)
+        recip[n] = ((1ULL << RECIP_SHIFT) + n - 1) / n;
+}
+#endif
+
+/* per sample mean of a group, 32-bit ARM has no 64-bit divide */
+static inline long long pcr_div_count(long long x, int n)
+{
+#ifdef PCR_FIXED_POINT
+    if (n <= CLOCK_RECORD_NUM && llabs(x) < ((long long)n << RECIP_X_BITS)) {
+        uint64_t q = ((uint64_t)llabs(x) * recip[n]) >> RECIP_SHIFT;
+
+        return x < 0 ? -(long long)q : (long long)q;
+    }
+#endif
+    return x / n;
+}
 
 enum error_return {
     INVALID_PARAMETER = -1,
@@ -53,8 +94,18 @@ enum error_return {
 
 struct pcr_group {
     int invalid_count;
+    /* all samples, for avg_pcr */
     long long total_pts;
     long long total_monoclk;
+    /* samples within RECORD_BIAS_MAX, for adjust_avg_pcr */
+    int valid_count;
+    long long valid_pts;
+    long long valid_monoclk;
+    /* valid pts - monoclk relative to the first one, small enough for
+     * pcr_div_count
+     */
+    long long off_base;
+    long long off_sum;
     struct pcr_info start_pcr;
     struct pcr_info last_pcr;
     struct pcr_info avg_pcr;
@@ -62,12 +113,24 @@ struct pcr_group {
 };
 
 struct clock_record {
+    /* samples in current group, kept up to date as they arrive */
     int pcr_index;
+    int reject_run;
+    /* rejects since the last accepted sample counted in current group's
+     * totals, runs that did not rebase included, all move on a rebase
+     */
+    int run_in_group;
+    /* biases of the run against last_offset */
+    long long run_off[GROUP_RESEED_RUN];
+    /* added to pts, keeps the timeline continuous across discontinuities */
+    long long seg_offset;
+    /* pts - monoclk of the last accepted sample */
+    long long last_offset;
+    int rebase_count;
     int group_start;
     int group_next;
     int new_group_arrived;
     struct pcr_group group[MONITOR_GROUP_NUM];
-    struct pcr_info pcr[CLOCK_RECORD_NUM];
 };
 
 struct monitor_info {
@@ -89,23 +152,6 @@ static int get_record_deviation(struct clock_record * record, int start, int end
 static int adjust_deviation(struct monitor_info *monitor_info, struct clock_record * record);
 static int output_deviation(struct monitor_info *monitor_info, struct clock_record * record);
 
-#ifdef DUMP_TO_FILE
-static int file_index = 0;
-
-static void dump(const char* path, long long pts, long long mono) {
-    FILE* fd;
-    char name[50];
-
-    sprintf(name, "%s%d.txt", path, file_index);
-
-    fd = fopen(name, "a");
-    if (!fd)
-        return;
-    fprintf(fd, "%llu, %llu\n", pts, mono);
-    fclose(fd);
-}
-#endif
-
 
 static int get_record_deviation(struct clock_record * record, int start, int end, int *deviation)
 {
@@ -316,83 +362,131 @@ static int adjust_deviation(struct monitor_info *monitor_info, struct clock_reco
     return 0;
 }
 
-static int adjust_group_avg(struct clock_record *record, struct pcr_group * group)
+/* pts - monoclk of @group's valid samples so far, or of the group before */
+static bool group_ref_offset(struct clock_record *record,
+        struct pcr_group *group, long long *offset)
 {
-    int i;
-    struct pcr_info * current = &record->pcr[0];
-    long long total_pts = 0;
-    long long total_mono_clk = 0;
-    long long pts_diff;
-    long long clk_diff;
-    int validcount = 0;
-    struct pcr_info * valid_pcr = &record->pcr[0];
-
-    for (i=0; i <(CLOCK_RECORD_NUM); i++) {
+    struct pcr_group *prev;
 
-        pts_diff = current->pts - group->avg_pcr.pts;
-        clk_diff = current->monoclk - group->avg_pcr.monoclk;
-        if(abs(pts_diff - clk_diff) > RECORD_BIAS_MAX) {
-            group->invalid_count ++;
-            log_pcr_trace("[%d] drop, invalid count: %d, pts_diff:%lld, clk_diff:%lld", i, group->invalid_count, pts_diff, clk_diff);
-        } else {
-            valid_pcr->monoclk = current->monoclk;
-            valid_pcr->pts = current->pts;
-            total_pts += current->pts;
-            total_mono_clk += current->monoclk;
-            validcount ++;
-            valid_pcr ++;
-        }
-        current ++;
+    if (group->valid_count) {
+        *offset = group->off_base +
+            pcr_div_count(group->off_sum, group->valid_count);
+        return true;
     }
-    group->total_monoclk = total_mono_clk;
-    group->total_pts = total_pts;
-    record->pcr_index = validcount;
-
-    log_pcr_debug("valid count:%d, monoclk:%lld, pts: %lld", validcount, total_mono_clk, total_pts);
-
-    if (validcount < 980)
-        return -1;
-
-    group->adjust_avg_pcr.monoclk = total_mono_clk / validcount;
-    group->adjust_avg_pcr.pts = total_pts / validcount;
-
-    return 0;
-}
-
-
-static bool pcr_group_is_valid(struct clock_record *record, struct pcr_group * group)
-{
-    if (adjust_group_avg(record, group) < 0)
+    if (record->group_next == record->group_start)
         return false;
-
+    prev = &record->group[(record->group_next + MONITOR_GROUP_NUM - 1) % MONITOR_GROUP_NUM];
+    *offset = prev->adjust_avg_pcr.pts - prev->adjust_avg_pcr.monoclk;
     return true;
 }
 
+/* Mean of a full run of biases when all but at most one, the sorted
+ * first or last, are within GROUP_RUN_SPREAD_MAX. Leaves run_off sorted.
+ */
+static int group_run_bias(struct clock_record *record, long long *bias)
+{
+    long long *off = record->run_off, v, sum = 0;
+    int i, j, lo = 0, hi = GROUP_RESEED_RUN - 1;
+
+    for (i = 1; i < GROUP_RESEED_RUN; i++) {
+        v = off[i];
+        for (j = i; j > 0 && off[j - 1] > v; j--)
+            off[j] = off[j - 1];
+        off[j] = v;
+    }
+    if (off[hi] - off[lo] > GROUP_RUN_SPREAD_MAX) {
+        /* drop the one further from the median */
+        if (off[hi] - off[hi / 2] > off[hi / 2 + 1] - off[lo])
+            hi--;
+        else
+            lo++;
+        if (off[hi] - off[lo] > GROUP_RUN_SPREAD_MAX)
+            return -1;
+    }
+    for (i = lo; i <= hi; i++)
+        sum += off[i];
+    *bias = sum / (hi - lo + 1);
+    return 0;
+}
 
-static bool pcr_group_has_big_gap(struct clock_record *record)
+/* Sums are kept as samples arrive, so a full group costs no more than
+ * any other sample. Bias is checked against the running offset of valid
+ * samples: drift within a group is a few ms at most, far below
+ * RECORD_BIAS_MAX.
+ */
+static void group_add_sample(struct clock_record *record,
+        struct pcr_group *group, struct pcr_info *pcr)
 {
-    int i;
-    struct pcr_info * current = &record->pcr[0];
-    struct pcr_info * next = &record->pcr[1];
-    int diff;
-    for (i=0; i <(CLOCK_RECORD_NUM-1); i++) {
-        diff = next->pts - current->pts;
-        if (diff > 0) {
-            if (diff > MONITOR_PCR_BIG_GAP) {
-                log_pcr_error("pcr may has big jump:%d", diff);
-            }
-        } else {
-            diff = abs(diff);
-            if (diff > MONITOR_PCR_BIG_GAP) {
-                log_pcr_error("pcr has big back:%d", diff);
-                return true;
+    long long ref, bias, off;
+
+    if (!record->pcr_index) {
+        group->start_pcr = *pcr;
+        record->run_in_group = 0;
+    }
+    group->total_monoclk += pcr->monoclk;
+    group->total_pts += pcr->pts;
+    record->pcr_index++;
+
+    if (group_ref_offset(record, group, &ref)) {
+        bias = pcr->pts - pcr->monoclk - ref;
+        if (llabs(bias) > RECORD_BIAS_MAX) {
+            /* against the last accepted sample, not the group mean
+             * which lags by the drift
+             */
+            off = pcr->pts - pcr->monoclk - record->last_offset;
+            record->run_off[record->reject_run] = off;
+            group->invalid_count++;
+            record->reject_run++;
+            record->run_in_group++;
+            log_pcr_trace("[%d] drop, invalid count: %d, bias:%lld",
+                record->pcr_index, group->invalid_count, bias);
+            if (record->reject_run < GROUP_RESEED_RUN)
+                goto exit;
+            if (group->valid_count && group->valid_count < GROUP_RESEED_RUN &&
+                    record->group_next == record->group_start) {
+                /* outvoted, the first samples were off, not the rest */
+                log_pcr_info("reseed group, valid:%d", group->valid_count);
+                group->valid_count = 0;
+                group->valid_pts = 0;
+                group->valid_monoclk = 0;
+            } else if (group_run_bias(record, &bias)) {
+                /* not one new segment, keep dropping. The run stays in
+                 * run_in_group, a later rebase moves it as well.
+                 */
+                log_pcr_info("reject run spread %lld us, no rebase",
+                    record->run_off[GROUP_RESEED_RUN - 1] -
+                    record->run_off[0]);
+                record->reject_run = 0;
+                goto exit;
+            } else {
+                /* The run is the new segment, move it back next to the
+                 * last accepted sample by its mean bias. The whole
+                 * segment shifts by the same amount, the rejects
+                 * already in the totals included.
+                 */
+                record->seg_offset -= bias;
+                record->rebase_count++;
+                log_pcr_info("discontinuity %lld us, rebase %d", bias,
+                    record->rebase_count);
+                pcr->pts -= bias;
+                group->total_pts -= bias * record->run_in_group;
             }
         }
-        current ++;
-        next ++;
     }
-
-    return false;
+    record->reject_run = 0;
+    record->run_in_group = 0;
+    record->last_offset = pcr->pts - pcr->monoclk;
+    if (!group->valid_count) {
+        group->off_base = record->last_offset;
+        group->off_sum = 0;
+    } else {
+        group->off_sum += record->last_offset - group->off_base;
+    }
+    group->valid_count++;
+    group->valid_pts += pcr->pts;
+    group->valid_monoclk += pcr->monoclk;
+exit:
+    group->last_pcr = *pcr;
 }
 
 static int pcr_monitor_reset(struct monitor_info *monitor_handle)
@@ -418,9 +512,9 @@ static int pcr_monitor_record(struct monitor_info * info, struct pcr_info *pcr)
     int index;
     int group_next;
     int group_start;
-    struct pcr_info *pcr_record;
     struct pcr_group *current_group;
     struct clock_record *record;
+    struct pcr_info sample;
 
     if (info == NULL || pcr == NULL)
         return -1;
@@ -434,26 +528,12 @@ static int pcr_monitor_record(struct monitor_info * info, struct pcr_info *pcr)
     log_pcr_debug("monoclk:%lld, pts:%lld, group start:%d, end:%d, record index:%d", pcr->monoclk, pcr->pts,
         group_start, group_next, index);
 
-#ifdef DUMP_TO_FILE
-    dump("/data/pcr_monitor_record_", pcr->monoclk, pcr->pts);
-#endif
+    sample = *pcr;
+    sample.pts += record->seg_offset;
     current_group = &record->group[group_next];
-    pcr_record = &record->pcr[index];
-    if (index < CLOCK_RECORD_NUM) {
-        pcr_record->monoclk = pcr->monoclk;
-        pcr_record->pts = pcr->pts;
-        record->pcr_index ++;
-
-        current_group->total_monoclk += pcr->monoclk;
-        current_group->total_pts += pcr->pts;
-    }
+    group_add_sample(record, current_group, &sample);
 
     if (record->pcr_index == CLOCK_RECORD_NUM) {
-        current_group->start_pcr.monoclk = record->pcr[0].monoclk;
-        current_group->start_pcr.pts = record->pcr[0].pts;
-        current_group->last_pcr.monoclk = record->pcr[CLOCK_RECORD_NUM - 1].monoclk;
-        current_group->last_pcr.pts = record->pcr[CLOCK_RECORD_NUM - 1].pts;
-
         current_group->avg_pcr.monoclk = current_group->total_monoclk / CLOCK_RECORD_NUM;
         current_group->avg_pcr.pts = current_group->total_pts / CLOCK_RECORD_NUM;
 
@@ -462,13 +542,14 @@ static int pcr_monitor_record(struct monitor_info * info, struct pcr_info *pcr)
             current_group->start_pcr.monoclk, current_group->start_pcr.pts,
             current_group->last_pcr.monoclk, current_group->last_pcr.pts,
             current_group->avg_pcr.monoclk, current_group->avg_pcr.pts);
-
-        if (pcr_group_has_big_gap(record)) {
-            pcr_monitor_reset(info);
-            return -1;
-        }
-
-        if (pcr_group_is_valid(record, current_group)) {
+        log_pcr_debug("valid count:%d, monoclk:%lld, pts: %lld", current_group->valid_count,
+            current_group->valid_monoclk, current_group->valid_pts);
+
+        if (current_group->valid_count >= GROUP_VALID_MIN) {
+            current_group->adjust_avg_pcr.monoclk =
+                current_group->valid_monoclk / current_group->valid_count;
+            current_group->adjust_avg_pcr.pts =
+                current_group->valid_pts / current_group->valid_count;
             record->pcr_index = 0;
             record->new_group_arrived = 1;
             record->group_next = (++ group_next) % MONITOR_GROUP_NUM;
@@ -476,28 +557,31 @@ static int pcr_monitor_record(struct monitor_info * info, struct pcr_info *pcr)
                 memset(&record->group[group_start], 0, sizeof(struct pcr_group));
                 record->group_start = (++ group_start) % MONITOR_GROUP_NUM;
             }
+        } else {
+            /* keep the valid samples and fill up again, pending rejects
+             * are gone from the totals
+             */
+            current_group->total_pts = current_group->valid_pts;
+            current_group->total_monoclk = current_group->valid_monoclk;
+            record->pcr_index = current_group->valid_count;
+            record->run_in_group = 0;
         }
     }
 
     return 0;
 }
 
-int pcr_monitor_init(void ** monitor_handle)
+static void* group_create(void)
 {
     struct monitor_info * monitor;
-    int ret = 0;
-    if (monitor_handle == NULL)
-        return -1;
 
-#ifdef DUMP_TO_FILE
-    file_index ++;
+#ifdef PCR_FIXED_POINT
+    pthread_once(&recip_once, recip_init);
 #endif
 
     monitor = calloc(1, sizeof(struct monitor_info));
-    if (!monitor) {
-        ret = -ENOMEM;
-        goto err;
-    }
+    if (!monitor)
+        return NULL;
 
     monitor->status = RECORDING;
     monitor->probe_step = MONITOR_START_STEP;
@@ -507,20 +591,15 @@ int pcr_monitor_init(void ** monitor_handle)
 
     memset(&monitor->record, 0, sizeof(struct clock_record));
 
-    *monitor_handle = (void *) monitor;
-
-err:
-    return ret;
+    return monitor;
 }
 
-int pcr_monitor_process(void *monitor_handle, struct pcr_info *pcr)
+static int group_process(void *monitor_handle, struct pcr_info *pcr)
 {
     int status;
     int record_count = 0;
     struct clock_record *record;
     struct monitor_info *info = (struct monitor_info *)monitor_handle;;
-    if (monitor_handle == NULL || pcr == NULL)
-        return -1;
 
     record = &info->record;
 
@@ -570,21 +649,17 @@ int pcr_monitor_process(void *monitor_handle, struct pcr_info *pcr)
     return 0;
 }
 
-enum pcr_monitor_status  pcr_monitor_get_status(void *monitor_handle)
+static enum pcr_monitor_status group_get_status(void *monitor_handle)
 {
     struct monitor_info * info = (struct monitor_info *)monitor_handle;
-    if (monitor_handle == NULL)
-        return INVALID_PARAMETER;
 
     return info->status;
 }
 
-int pcr_monitor_get_deviation(void *monitor_handle, int *ppm)
+static int group_get_deviation(void *monitor_handle, int *ppm)
 {
     int ret = 0;
     struct monitor_info * info = (struct monitor_info *)monitor_handle;
-    if (monitor_handle == NULL || ppm == NULL)
-        return INVALID_PARAMETER;
 
     if (info->status >= DEVIATION_READY) {
         *ppm = info->deviation;
@@ -596,12 +671,138 @@ int pcr_monitor_get_deviation(void *monitor_handle, int *ppm)
     return ret;
 }
 
+static void group_reset(void *monitor_handle)
+{
+    memset(monitor_handle, 0, sizeof(struct monitor_info));
+    pcr_monitor_reset((struct monitor_info *)monitor_handle);
+}
+
+static void group_destroy(void *monitor_handle)
+{
+    free(monitor_handle);
+}
+
+const struct pcr_estimator pcr_group_estimator = {
+    .name = "group",
+    .create = group_create,
+    .destroy = group_destroy,
+    .reset = group_reset,
+    .process = group_process,
+    .get_status = group_get_status,
+    .get_deviation = group_get_deviation,
+};
+
+struct pcr_monitor {
+    const struct pcr_estimator *est;
+    void *priv;
+    /* AML_AVSYNC_PCR_CAPTURE, looked up on the first sample */
+    void *capture;
+    bool capture_checked;
+};
+
+static const struct pcr_estimator *estimators[PCR_EST_MAX] = {
+    [PCR_EST_GROUP] = &pcr_group_estimator,
+    [PCR_EST_LSQ] = &pcr_lsq_estimator,
+    [PCR_EST_KALMAN] = &pcr_kalman_estimator,
+};
+
+int pcr_monitor_init_ex(void ** monitor_handle, enum pcr_estimator_type type)
+{
+    struct pcr_monitor *monitor;
+
+    if (monitor_handle == NULL || type < 0 || type >= PCR_EST_MAX)
+        return INVALID_PARAMETER;
+
+    monitor = calloc(1, sizeof(*monitor));
+    if (!monitor)
+        return -ENOMEM;
+    monitor->est = estimators[type];
+    monitor->priv = monitor->est->create();
+    if (!monitor->priv) {
+        free(monitor);
+        return -ENOMEM;
+    }
+    log_pcr_info("estimator %s", monitor->est->name);
+    *monitor_handle = monitor;
+    return 0;
+}
+
+int pcr_monitor_init(void ** monitor_handle)
+{
+    return pcr_monitor_init_ex(monitor_handle, PCR_EST_GROUP);
+}
+
+int pcr_monitor_process(void *monitor_handle, struct pcr_info *pcr)
+{
+    struct pcr_monitor *monitor = monitor_handle;
+
+    if (monitor_handle == NULL || pcr == NULL)
+        return INVALID_PARAMETER;
+
+    if (!monitor->capture_checked) {
+        monitor->capture = pcr_capture_open();
+        monitor->capture_checked = true;
+    }
+    pcr_capture_write(monitor->capture, pcr);
+    return monitor->est->process(monitor->priv, pcr);
+}
+
+enum pcr_monitor_status pcr_monitor_get_status(void *monitor_handle)
+{
+    struct pcr_monitor *monitor = monitor_handle;
+
+    if (monitor_handle == NULL)
+        return INVALID_PARAMETER;
+
+    return monitor->est->get_status(monitor->priv);
+}
+
+int pcr_monitor_get_deviation(void *monitor_handle, int *ppm)
+{
+    struct pcr_monitor *monitor = monitor_handle;
+
+    if (monitor_handle == NULL || ppm == NULL)
+        return INVALID_PARAMETER;
+
+    return monitor->est->get_deviation(monitor->priv, ppm);
+}
+
+int pcr_monitor_get_confidence(void *monitor_handle, int *ci_ppm)
+{
+    struct pcr_monitor *monitor = monitor_handle;
+
+    if (monitor_handle == NULL || ci_ppm == NULL)
+        return INVALID_PARAMETER;
+    if (!monitor->est->get_confidence)
+        return INVALID_STATUS;
+
+    return monitor->est->get_confidence(monitor->priv, ci_ppm);
+}
+
+int pcr_monitor_recycle(void *monitor_handle)
+{
+    struct pcr_monitor *monitor = monitor_handle;
+
+    if (monitor_handle == NULL)
+        return INVALID_PARAMETER;
+
+    monitor->est->reset(monitor->priv);
+    pcr_capture_close(monitor->capture);
+    monitor->capture = NULL;
+    monitor->capture_checked = false;
+    return 0;
+}
+
 int pcr_monitor_destroy(void *monitor_handle)
 {
+    struct pcr_monitor *monitor = monitor_handle;
+
     if (monitor_handle == NULL)
          return INVALID_PARAMETER;
 
-    free(monitor_handle);
+    monitor->est->destroy(monitor->priv);
+    pcr_capture_close(monitor->capture);
+    free(monitor);
 
     return 0;
 }
@@ -16,6 +16,8 @@
 #ifndef AML_AVSYNC_PCR_MONITOR_H
 #define AML_AVSYNC_PCR_MONITOR_H
 
+#include <stdint.h>
+
 struct pcr_info {
     long long pts; //unit as us
     long long monoclk; //unint as us
@@ -30,10 +32,39 @@ enum pcr_monitor_status {
     DEVIATION_LONG_TERM_READY,
 };
 
+enum pcr_estimator_type {
+    /* 1000 sample groups, minutes to converge */
+    PCR_EST_GROUP = 0,
+    /* streaming least squares, constant memory */
+    PCR_EST_LSQ,
+    /* Kalman filter, ppm with confidence interval within seconds */
+    PCR_EST_KALMAN,
+    PCR_EST_MAX,
+};
+
+/* 90KHz PCR to us, once per PCR packet */
+static inline long long pcr_pts_to_us(uint32_t pts)
+{
+#ifdef PCR_FIXED_POINT
+    /* pts * 100 / 9 is pts * 11 + pts / 9, and pts / 9 of 32 bits is
+     * pts * ceil(2^35 / 9) >> 35 without 64-bit divide
+     */
+    return (long long)pts * 11 + (((uint64_t)pts * 0xE38E38E4ULL) >> 35);
+#else
+    return (long long)pts * 1000 / 90;
+#endif
+}
+
+/* same as pcr_monitor_init_ex with PCR_EST_GROUP */
 int pcr_monitor_init(void ** monitor_handle);
+int pcr_monitor_init_ex(void ** monitor_handle, enum pcr_estimator_type type);
 int pcr_monitor_process(void *monitor_handle, struct pcr_info *pcr);
 enum pcr_monitor_status pcr_monitor_get_status(void *monitor_handle);
 int pcr_monitor_get_deviation(void *monitor_handle, int *ppm);
+/* 95% half width of the deviation in ppm, not all estimators have it */
+int pcr_monitor_get_confidence(void *monitor_handle, int *ci_ppm);
+/* drop all history, as if just initialized */
+int pcr_monitor_recycle(void *monitor_handle);
 int pcr_monitor_destroy(void *monitor_handle);
 
 #endif
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: replay PCR traces through pcr_monitor_process as fast
+ * as possible, to compare the estimators and evaluate changes to them.
+ *
+ * Usage: pcr_replay [-e group|lsq|kalman] [-r ppm] [-n passes] [-c] [-t]
+ *                   [-s ppm,jitter us,seconds[,splice s]] [capture]...
+ * A capture is written with AML_AVSYNC_PCR_CAPTURE, see pcr_capture.h,
+ * or is a text file of "monoclk, pts" lines, both in us.
+ * -s makes a 25Hz PCR stream instead, with gaussian jitter on monoclk
+ * and one sample in 500 late by 50ms, and with a PCR jump of up to
+ * +/-30s every [splice s] seconds.
+ * -t runs the synthetic cases of check_cases[] once, fails when an
+ * estimator is never ready, drops out of ready or ends off reference.
+ * -c also times the 90KHz to us conversion. Build once as is and once
+ * with FIXED_POINT=yes to compare, the results must match.
+ * Reference ppm is the end to end slope of a capture, or the ppm of -s,
+ * unless -r is given. -r is needed for captures with discontinuities.
+ * Converged is from when the deviation stays within 2ppm of reference.
+ * One timed pass shows accuracy and the cost of each call as
+ * percentiles and a log2 histogram in ns, then [passes] untimed ones
+ * show throughput.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aml_avsync_log.h"
+#include "pcr_capture.h"
+#include "pcr_monitor.h"
+
+#define DEF_PASSES 5
+#define CONVERGED_PPM 2
+#define LAT_BUCKETS 20
+#define SYNTH_INTERVAL_US 40000
+#define SYNTH_LATE_US 50000
+#define CONVERT_NUM 10000000
+
+struct synth_case {
+    double ppm;
+    double jitter;
+    int seconds;
+    int splice;
+};
+
+/* Splices every 20 to 120s. At 60s and more one of the late samples
+ * lands in the reject run after a splice, the run must still rebase.
+ */
+static const struct synth_case check_cases[] = {
+    { 37, 300, 1200, 20 },
+    { 37, 50, 1500, 20 },
+    { 37, 300, 1800, 60 },
+    { 20, 300, 1800, 60 },
+    { -20, 300, 1800, 120 },
+    { 37, 50, 1800, 60 },
+    { 37, 300, 1800, 90 },
+};
+
+static const char *est_name[PCR_EST_MAX] = {
+    [PCR_EST_GROUP] = "group",
+    [PCR_EST_LSQ] = "lsq",
+    [PCR_EST_KALMAN] = "kalman",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_latency(uint32_t *lat, int num)
+{
+    int hist[LAT_BUCKETS] = { 0 };
+    int i, b, last = 0;
+
+    for (i = 0; i < num; i++) {
+        for (b = 0; b < LAT_BUCKETS - 1 && (lat[i] >> b) > 1; b++)
+            ;
+        hist[b]++;
+        if (b > last)
+            last = b;
+    }
+    qsort(lat, num, sizeof(*lat), cmp_u32);
+    printf("         ns/call p50 %u p99 %u p99.9 %u max %u\n",
+            lat[num / 2], lat[num * 99 / 100], lat[num * 999 / 1000],
+            lat[num - 1]);
+    printf("        ");
+    for (b = 6; b <= last; b++)
+        printf(" <%u:%d", 2u << b, hist[b] + (b == 6 ? hist[0] + hist[1] +
+                    hist[2] + hist[3] + hist[4] + hist[5] : 0));
+    printf("\n");
+}
+
+static void bench_convert(void)
+{
+    uint64_t start, cost, sum = 0;
+    uint32_t pts = 0x12345678;
+    int i;
+
+    start = now_ns();
+    for (i = 0; i < CONVERT_NUM; i++) {
+        /* wraps through the whole 32-bit range */
+        pts += 0x9E3779B1;
+        sum += pcr_pts_to_us(pts);
+    }
+    cost = now_ns() - start;
+#ifdef PCR_FIXED_POINT
+    printf("fixed point build, ");
+#else
+    printf("64-bit divide build, ");
+#endif
+    printf("pts_to_us %.2f ns, checksum %llx\n",
+            (double)cost / CONVERT_NUM, (unsigned long long)sum);
+}
+
+static double gauss(void)
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static int synth_trace(double ppm, double jitter, int seconds, int splice,
+        struct pcr_info **trace, int *num)
+{
+    long long t, jump = 0;
+    int n = 0;
+
+    *num = seconds * (1000000LL / SYNTH_INTERVAL_US);
+    *trace = calloc(*num, sizeof(**trace));
+    if (!*trace)
+        return -1;
+    srand(1);
+    for (t = 0; n < *num; t += SYNTH_INTERVAL_US, n++) {
+        (*trace)[n].monoclk = 1000000000LL + t +
+            (long long)(gauss() * jitter);
+        if (rand() % 500 == 0)
+            (*trace)[n].monoclk += SYNTH_LATE_US;
+        if (splice && t && t % (splice * 1000000LL) == 0)
+            jump += (rand() % 60001 - 30000) * 1000LL;
+        (*trace)[n].pts = 100000000LL + jump +
+            (long long)(t * (1 + ppm * 1e-6));
+    }
+    return 0;
+}
+
+/* accuracy and per call latency, one timed pass.
+ * 1 when never ready, dropped out of ready or final is off reference
+ */
+static int replay_timed(enum pcr_estimator_type type,
+        const struct pcr_info *trace, int num, double ref, uint32_t *lat)
+{
+    double ready = -1, converged = -1, err_sum = 0, t;
+    int i, ppm = 0, ci, first = 0, last = 0, changes = 0, drops = 0;
+    int err_cnt = 0;
+    char ci_str[8] = "-", conv_str[16] = "-";
+    struct pcr_info pcr;
+    uint64_t start, c;
+    void *monitor;
+
+    if (pcr_monitor_init_ex(&monitor, type))
+        return -1;
+    for (i = 0; i < num; i++) {
+        /* estimators may touch the sample */
+        pcr = trace[i];
+        start = now_ns();
+        pcr_monitor_process(monitor, &pcr);
+        c = now_ns() - start;
+        lat[i] = c > UINT32_MAX ? UINT32_MAX : c;
+
+        t = (trace[i].monoclk - trace[0].monoclk) / 1e6;
+        if (pcr_monitor_get_status(monitor) < DEVIATION_READY) {
+            if (ready >= 0 && !drops++)
+                printf("%-8s not ready again at %.1fs\n", est_name[type], t);
+            converged = -1;
+            continue;
+        }
+        pcr_monitor_get_deviation(monitor, &ppm);
+        if (ready < 0) {
+            ready = t;
+            first = last = ppm;
+        } else if (ppm != last) {
+            changes++;
+            last = ppm;
+        }
+        err_sum += fabs(ppm - ref);
+        err_cnt++;
+        if (fabs(ppm - ref) > CONVERGED_PPM)
+            converged = -1;
+        else if (converged < 0)
+            converged = t;
+    }
+    if (!pcr_monitor_get_confidence(monitor, &ci))
+        snprintf(ci_str, sizeof(ci_str), "%d", ci);
+    if (converged >= 0)
+        snprintf(conv_str, sizeof(conv_str), "%.1fs", converged);
+    pcr_monitor_destroy(monitor);
+
+    if (ready < 0)
+        printf("%-8s never ready\n", est_name[type]);
+    else
+        printf("%-8s ready %7.1fs converged %8s first %4d final %4d "
+                "+/- %2s changes %3d drops %d mean err %5.1f ppm\n",
+                est_name[type], ready, conv_str, first, ppm, ci_str,
+                changes, drops, err_sum / err_cnt);
+    print_latency(lat, num);
+    return ready < 0 || drops || fabs(ppm - ref) > CONVERGED_PPM;
+}
+
+/* throughput, no clock read per sample */
+static void replay_fast(enum pcr_estimator_type type,
+        const struct pcr_info *trace, int num, int passes,
+        struct pcr_info *work)
+{
+    uint64_t start, cost = 0;
+    void *monitor;
+    int p;
+
+    for (p = 0; p < passes; p++) {
+        int i;
+
+        if (pcr_monitor_init_ex(&monitor, type))
+            return;
+        memcpy(work, trace, num * sizeof(*work));
+        start = now_ns();
+        for (i = 0; i < num; i++)
+            pcr_monitor_process(monitor, &work[i]);
+        cost += now_ns() - start;
+        pcr_monitor_destroy(monitor);
+    }
+    printf("         %.1f ns/sample, %.2f M samples/s, %.1fx real time\n",
+            (double)cost / num / passes,
+            (double)num * passes * 1000 / cost,
+            (trace[num - 1].monoclk - trace[0].monoclk) * 1e3 * passes /
+            cost);
+}
+
+/* Takes @trace. With @check, 1 when an estimator did not hold, see
+ * replay_timed
+ */
+static int replay(const char *name, struct pcr_info *trace, int num,
+        int est, double ref, int passes, bool check)
+{
+    enum pcr_estimator_type type;
+    struct pcr_info *work;
+    long long mono_diff;
+    uint32_t *lat;
+    int ret, rc = 0;
+
+    if (num < 2) {
+        printf("%s: too short\n", name);
+        free(trace);
+        return -1;
+    }
+    lat = calloc(num, sizeof(*lat));
+    work = calloc(num, sizeof(*work));
+    if (!lat || !work) {
+        free(lat);
+        free(work);
+        free(trace);
+        return -1;
+    }
+
+    mono_diff = trace[num - 1].monoclk - trace[0].monoclk;
+    /* end to end slope, fine as reference for a long clean trace */
+    if (isnan(ref))
+        ref = (double)(trace[num - 1].pts - trace[0].pts - mono_diff) *
+            1e6 / mono_diff;
+    printf("%s: %d samples, %.1fs, reference %.1f ppm\n",
+            name, num, mono_diff / 1e6, ref);
+
+    for (type = 0; type < PCR_EST_MAX; type++) {
+        if (est >= 0 && type != est)
+            continue;
+        ret = replay_timed(type, trace, num, ref, lat);
+        if (ret < 0) {
+            printf("%-8s init fail\n", est_name[type]);
+            rc = -1;
+            continue;
+        }
+        if (check && ret) {
+            printf("%-8s FAIL\n", est_name[type]);
+            rc = 1;
+        }
+        if (passes)
+            replay_fast(type, trace, num, passes, work);
+    }
+    free(lat);
+    free(work);
+    free(trace);
+    return rc;
+}
+
+static int check(int est)
+{
+    const struct synth_case *c;
+    struct pcr_info *trace;
+    char name[64];
+    int i, num, rc = 0;
+
+    for (i = 0; i < (int)(sizeof(check_cases) / sizeof(check_cases[0]));
+            i++) {
+        c = &check_cases[i];
+        snprintf(name, sizeof(name), "-s %g,%g,%d,%d", c->ppm, c->jitter,
+                c->seconds, c->splice);
+        if (synth_trace(c->ppm, c->jitter, c->seconds, c->splice,
+                    &trace, &num) ||
+                replay(name, trace, num, est, c->ppm, 0, true))
+            rc = 1;
+    }
+    printf("%s\n", rc ? "FAIL" : "PASS");
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    double ref = NAN, synth_ppm = 0, synth_jitter = 0;
+    int synth_seconds = 0, synth_splice = 0;
+    int passes = DEF_PASSES, convert = 0, run_check = 0;
+    int est = -1, opt, i, num, rc = 0;
+    struct pcr_info *trace;
+
+    while ((opt = getopt(argc, argv, "e:r:n:s:ct")) != -1) {
+        switch (opt) {
+        case 'e':
+            for (est = 0; est < PCR_EST_MAX; est++)
+                if (!strcmp(optarg, est_name[est]))
+                    break;
+            if (est == PCR_EST_MAX)
+                goto usage;
+            break;
+        case 'r':
+            ref = atof(optarg);
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            if (passes <= 0)
+                goto usage;
+            break;
+        case 's':
+            if (sscanf(optarg, "%lf,%lf,%d,%d", &synth_ppm, &synth_jitter,
+                        &synth_seconds, &synth_splice) < 3 ||
+                    synth_seconds <= 0 || synth_splice < 0)
+                goto usage;
+            break;
+        case 'c':
+            convert = 1;
+            break;
+        case 't':
+            run_check = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind == argc && !synth_seconds && !convert && !run_check)
+        goto usage;
+
+    /* replaying must not write captures of its own */
+    unsetenv("AML_AVSYNC_PCR_CAPTURE");
+    log_set_level(AVS_LOG_ERROR);
+    if (convert)
+        bench_convert();
+    if (run_check && check(est))
+        rc = 1;
+    if (synth_seconds) {
+        if (synth_trace(synth_ppm, synth_jitter, synth_seconds,
+                    synth_splice, &trace, &num))
+            return 1;
+        if (replay("synth", trace, num, est,
+                    isnan(ref) ? synth_ppm : ref, passes, false))
+            rc = 1;
+    }
+    for (i = optind; i < argc; i++) {
+        if (pcr_capture_load(argv[i], &trace, &num)) {
+            printf("%s: load fail\n", argv[i]);
+            rc = 1;
+            continue;
+        }
+        if (replay(argv[i], trace, num, est, ref, passes, false))
+            rc = 1;
+    }
+    return rc;
+
+usage:
+    printf("usage: %s [-e group|lsq|kalman] [-r ppm] [-n passes] [-c] [-t]\n"
+            "       [-s ppm,jitter us,seconds[,splice s]] [capture]...\n",
+            argv[0]);
+    return 1;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: persisted PCR clock deviation per broadcast source.
+ * Board crystal against a broadcaster's PCR hardly moves over days, so
+ * the value a session converged to is a good start for the next one.
+ * The file is mapped once per process and guarded by flock, it is only
+ * touched on channel change and when an estimation converges.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aml_avsync_log.h"
+#include "ppm_cache.h"
+
+#define PPM_CACHE_PATH "/data/avsync_ppm_cache"
+#define PPM_CACHE_MAGIC 0x4d505041 /* "APPM" */
+#define PPM_CACHE_VERSION 1
+#define PPM_CACHE_ENTRIES 64
+/* anything beyond is not a crystal deviation, treat as corrupted */
+#define PPM_CACHE_MAX_PPM 500
+
+struct ppm_cache_entry {
+    /* 0 for a free entry */
+    uint64_t key;
+    int32_t ppm;
+    /* cache seq when stored, smallest is evicted first */
+    uint32_t seq;
+};
+
+struct ppm_cache_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    uint32_t reserved;
+    struct ppm_cache_entry entry[PPM_CACHE_ENTRIES];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ppm_cache_file *cache;
+static int cache_fd = -1;
+static bool cache_failed;
+
+static int cache_map(void)
+{
+    const char *path = getenv("AML_AVSYNC_PPM_CACHE");
+    struct stat st;
+    void *p;
+    int fd;
+
+    if (cache)
+        return 0;
+    if (cache_failed)
+        return -1;
+
+    if (!path)
+        path = PPM_CACHE_PATH;
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error("open %s errno %d", path, errno);
+        goto fail;
+    }
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) || (st.st_size != sizeof(*cache) &&
+                ftruncate(fd, sizeof(*cache)))) {
+        log_error("size %s errno %d", path, errno);
+        goto fail_close;
+    }
+    p = mmap(NULL, sizeof(*cache), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        log_error("mmap %s errno %d", path, errno);
+        goto fail_close;
+    }
+    cache = p;
+    if (cache->magic != PPM_CACHE_MAGIC ||
+            cache->version != PPM_CACHE_VERSION) {
+        log_info("init %s", path);
+        memset(cache, 0, sizeof(*cache));
+        cache->magic = PPM_CACHE_MAGIC;
+        cache->version = PPM_CACHE_VERSION;
+    }
+    flock(fd, LOCK_UN);
+    cache_fd = fd;
+    return 0;
+
+fail_close:
+    flock(fd, LOCK_UN);
+    close(fd);
+fail:
+    /* no persistent storage on this board, do not retry */
+    cache_failed = true;
+    return -1;
+}
+
+int ppm_cache_get(uint64_t key, int32_t *ppm)
+{
+    int i, rc = -1;
+
+    if (!key || !ppm)
+        return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_map())
+        goto exit;
+    flock(cache_fd, LOCK_SH);
+    for (i = 0; i < PPM_CACHE_ENTRIES; i++) {
+        if (cache->entry[i].key != key)
+            continue;
+        if (abs(cache->entry[i].ppm) <= PPM_CACHE_MAX_PPM) {
+            *ppm = cache->entry[i].ppm;
+            rc = 0;
+        }
+        break;
+    }
+    flock(cache_fd, LOCK_UN);
+exit:
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+int ppm_cache_put(uint64_t key, int32_t ppm)
+{
+    struct ppm_cache_entry *e = NULL;
+    int i, rc = -1;
+
+    if (!key || abs(ppm) > PPM_CACHE_MAX_PPM)
+        return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_map())
+        goto exit;
+    flock(cache_fd, LOCK_EX);
+    for (i = 0; i < PPM_CACHE_ENTRIES; i++) {
+        if (cache->entry[i].key == key) {
+            e = &cache->entry[i];
+            break;
+        }
+        if (!e || cache->entry[i].seq < e->seq)
+            e = &cache->entry[i];
+    }
+    e->key = key;
+    e->ppm = ppm;
+    e->seq = ++cache->seq;
+    msync(cache, sizeof(*cache), MS_ASYNC);
+    flock(cache_fd, LOCK_UN);
+    rc = 0;
+exit:
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
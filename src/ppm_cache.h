@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: converged PCR clock deviation per broadcast source,
+ * persisted in a small memory mapped file shared by all processes.
+ */
+#ifndef AML_AVSYNC_PPM_CACHE_H
+#define AML_AVSYNC_PPM_CACHE_H
+
+#include <stdint.h>
+
+/* 0 and @ppm on hit, -1 on miss or when the cache file is not usable */
+int ppm_cache_get(uint64_t key, int32_t *ppm);
+/* replaces the entry of @key, or the least recently stored one */
+int ppm_cache_put(uint64_t key, int32_t ppm);
+
+#endif
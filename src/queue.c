@@ -23,16 +23,29 @@
 #include "aml_avsync.h"
 #include "aml_queue.h"
 
+#define CACHE_LINE_SIZE 64
+
+/* ri/wi are free running, item index is (i & mask).
+ * Each side owns one cache line: its own index plus a cached copy
+ * of the other side's, refreshed only when the cache says full/empty.
+ */
 struct queue {
-    int max_len;
-    int ri; //read index
-    int wi; //write index
-    atomic_intptr_t *items;
+    /* reader */
+    _Alignas(CACHE_LINE_SIZE) atomic_uint ri;
+    uint32_t wi_cache;
+    /* writer */
+    _Alignas(CACHE_LINE_SIZE) atomic_uint wi;
+    uint32_t ri_cache;
+    /* read only after creation */
+    _Alignas(CACHE_LINE_SIZE) uint32_t max_len;
+    uint32_t mask;
+    void **items;
 };
 
 void* create_q(int max_len)
 {
     struct queue *q;
+    uint32_t size = 1;
 
     if (max_len <= 0) {
         printf("%s %d invalid max_len:%d\n",
@@ -40,12 +53,13 @@ void* create_q(int max_len)
         return NULL;
     }
 
-    q = (struct queue*)calloc(1, sizeof(*q));
-    if (!q) {
+    if (posix_memalign((void **)&q, CACHE_LINE_SIZE, sizeof(*q))) {
         printf("%s %d OOM\n", __func__, __LINE__);
         return NULL;
     }
-    q->items = (atomic_intptr_t *)calloc(max_len, sizeof(void *));
+    while (size < (uint32_t)max_len)
+        size <<= 1;
+    q->items = (void **)calloc(size, sizeof(void *));
     if (!q->items) {
         printf("%s %d OOM\n", __func__, __LINE__);
         free(q);
@@ -53,7 +67,10 @@ void* create_q(int max_len)
     }
 
     q->max_len = max_len;
-    q->ri = q->wi = 0;
+    q->mask = size - 1;
+    atomic_init(&q->ri, 0);
+    atomic_init(&q->wi, 0);
+    q->wi_cache = q->ri_cache = 0;
     return q;
 }
 
@@ -70,43 +87,60 @@ void destroy_q(void * queue)
 int queue_item(void *queue, void * item)
 {
     struct queue *q = queue;
-    int fullness;
+    uint32_t wi;
 
     if (!q)
         return -1;
-    fullness = q->wi - q->ri;
-    if (fullness < 0) fullness += q->max_len;
-    if (fullness >= q->max_len - 1)
-        return -1; // not enough space
+    wi = atomic_load_explicit(&q->wi, memory_order_relaxed);
+    if (wi - q->ri_cache >= q->max_len) {
+        q->ri_cache = atomic_load_explicit(&q->ri, memory_order_acquire);
+        if (wi - q->ri_cache >= q->max_len)
+            return -1; // not enough space
+    }
 
-    atomic_store(&q->items[q->wi], (atomic_intptr_t)item);
+    q->items[wi & q->mask] = item;
+    atomic_store_explicit(&q->wi, wi + 1, memory_order_release);
+    return 0;
+}
 
-    if (q->wi >= q->max_len - 1)
-        q->wi = 0;
-    else
-        q->wi++;
+int queue_items(void *queue, void **items, int n)
+{
+    struct queue *q = queue;
+    uint32_t wi;
+    int i;
+
+    if (!q || n < 0)
+        return -1;
+    wi = atomic_load_explicit(&q->wi, memory_order_relaxed);
+    if (wi - q->ri_cache + n > q->max_len) {
+        q->ri_cache = atomic_load_explicit(&q->ri, memory_order_acquire);
+        if (wi - q->ri_cache + n > q->max_len)
+            return -1; // not enough space
+    }
+
+    for (i = 0; i < n; i++)
+        q->items[(wi + i) & q->mask] = items[i];
+    /* reader sees all of them or none */
+    atomic_store_explicit(&q->wi, wi + n, memory_order_release);
     return 0;
 }
 
 int peek_item(void *queue, void** p_item, uint32_t cnt)
 {
     struct queue *q = queue;
-    int32_t index;
-    int fullness;
+    uint32_t ri;
 
     if (!q)
         return -1;
 
-    fullness = q->wi - q->ri;
-    if (fullness < 0) fullness += q->max_len;
-    if (fullness == 0 || fullness <= cnt)
-       return -1; //no enough to peek
-    index = q->ri;
-    index += cnt;
-    if (index >= q->max_len)
-        index -= q->max_len;
+    ri = atomic_load_explicit(&q->ri, memory_order_relaxed);
+    if (q->wi_cache - ri <= cnt) {
+        q->wi_cache = atomic_load_explicit(&q->wi, memory_order_acquire);
+        if (q->wi_cache - ri <= cnt)
+            return -1; //no enough to peek
+    }
 
-    *p_item = (void *)atomic_load(&q->items[index]);
+    *p_item = q->items[(ri + cnt) & q->mask];
 
     if (*p_item != NULL)
         return 0;
@@ -117,33 +151,34 @@ int peek_item(void *queue, void** p_item, uint32_t cnt)
 int dqueue_item(void *queue, void** p_item)
 {
     struct queue *q = queue;
-    int fullness;
+    uint32_t ri;
 
     if (!q)
         return -1;
-    fullness = q->wi - q->ri;
-    if (fullness < 0) fullness += q->max_len;
-    if (fullness == 0)
-        return -1; //empty
-
-    *p_item = (void *)atomic_load(&q->items[q->ri]);
-    q->items[q->ri] = 0;
+    ri = atomic_load_explicit(&q->ri, memory_order_relaxed);
+    if (q->wi_cache == ri) {
+        q->wi_cache = atomic_load_explicit(&q->wi, memory_order_acquire);
+        if (q->wi_cache == ri)
+            return -1; //empty
+    }
 
-    if (q->ri >= q->max_len - 1)
-        q->ri = 0;
-    else
-        q->ri++;
+    *p_item = q->items[ri & q->mask];
+    q->items[ri & q->mask] = NULL;
+    atomic_store_explicit(&q->ri, ri + 1, memory_order_release);
     return 0;
 }
 
 int queue_size(void *queue)
 {
     struct queue *q = queue;
-    int fullness;
+    uint32_t ri, wi;
 
     if (!q)
         return -1;
-    fullness = q->wi - q->ri;
-    if (fullness < 0) fullness += q->max_len;
-    return fullness;
+    /* either side may ask, read index first so size never goes negative */
+    ri = atomic_load_explicit(&q->ri, memory_order_acquire);
+    wi = atomic_load_explicit(&q->wi, memory_order_acquire);
+    if (wi - ri > q->max_len)
+        return q->max_len;
+    return wi - ri;
 }
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: frame queue cost, decoder thread to vsync thread
+ *
+ * Usage: queue_bench [items] [queue depth]
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "aml_queue.h"
+
+#define DEF_ITEMS 2000000
+#define DEF_DEPTH 32
+
+struct item {
+    uint64_t push_ns;
+};
+
+static void *q;
+static struct item *items;
+static int item_num;
+static uint64_t lat_sum, lat_max;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void * producer(void * arg)
+{
+    int i;
+
+    for (i = 0; i < item_num; i++) {
+        items[i].push_ns = now_ns();
+        while (queue_item(q, &items[i]))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void * consumer(void * arg)
+{
+    int i;
+    struct item *it;
+
+    for (i = 0; i < item_num; i++) {
+        uint64_t lat;
+
+        /* vsync side peeks first, then takes the frame */
+        while (peek_item(q, (void **)&it, 0))
+            sched_yield();
+        dqueue_item(q, (void **)&it);
+        lat = now_ns() - it->push_ns;
+        lat_sum += lat;
+        if (lat > lat_max)
+            lat_max = lat;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int i, depth = DEF_DEPTH;
+    uint64_t start, cost;
+    pthread_t p_t, c_t;
+    void *it;
+
+    item_num = DEF_ITEMS;
+    if (argc > 1)
+        item_num = atoi(argv[1]);
+    if (argc > 2)
+        depth = atoi(argv[2]);
+    if (item_num <= 0 || depth <= 0) {
+        printf("usage: %s [items] [queue depth]\n", argv[0]);
+        return 1;
+    }
+
+    items = calloc(item_num, sizeof(*items));
+    q = create_q(depth);
+    if (!items || !q) {
+        printf("OOM\n");
+        return 1;
+    }
+
+    /* same thread, no sharing */
+    start = now_ns();
+    for (i = 0; i < item_num; i++) {
+        queue_item(q, &items[i]);
+        peek_item(q, &it, 0);
+        dqueue_item(q, &it);
+    }
+    cost = now_ns() - start;
+    printf("single thread: %.1f ns per push+peek+pop\n",
+            (double)cost / item_num);
+
+    /* decoder thread to vsync thread */
+    start = now_ns();
+    pthread_create(&c_t, NULL, consumer, NULL);
+    pthread_create(&p_t, NULL, producer, NULL);
+    pthread_join(p_t, NULL);
+    pthread_join(c_t, NULL);
+    cost = now_ns() - start;
+    printf("two threads: %.1f ns per item, latency avg %.1f ns max %llu ns\n",
+            (double)cost / item_num, (double)lat_sum / item_num,
+            (unsigned long long)lat_max);
+
+    destroy_q(q);
+    free(items);
+    return 0;
+}
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: process-wide reactor for session fds
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include "aml_avsync_log.h"
+#include "msync_util.h"
+#include "reactor.h"
+
+#define REACTOR_MAX_EVENTS 16
+
+struct reactor_entry {
+    int fd;
+    reactor_cb cb;
+    void *priv;
+    /* cb is running on reactor thread */
+    bool busy;
+    /* removed by its own cb, freed by reactor thread */
+    bool removed;
+    struct reactor_entry *next;
+};
+
+static struct {
+    /* serializes add/remove, so thread start/stop never overlap */
+    pthread_mutex_t life_lock;
+    /* entries and busy flags */
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    struct reactor_entry *entries;
+    int users;
+    int epfd;
+    /* wakes the thread for shutdown, no periodic timeout needed */
+    int wake_fd;
+    bool running;
+    /* bumped to stop the current thread */
+    uint32_t gen;
+    pthread_t thread;
+} reactor = {
+    .life_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+    .epfd = -1,
+    .wake_fd = -1,
+};
+
+static struct reactor_entry *find_entry(int fd)
+{
+    struct reactor_entry *e;
+
+    for (e = reactor.entries; e; e = e->next)
+        if (e->fd == fd)
+            return e;
+    return NULL;
+}
+
+static void * reactor_thread(void *arg)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    uint32_t gen = (uint32_t)(uintptr_t)arg;
+    int i, n;
+
+    prctl (PR_SET_NAME, "avs_reactor");
+    log_info("enter");
+    while (__atomic_load_n(&reactor.gen, __ATOMIC_ACQUIRE) == gen) {
+        n = msync_session_epoll_wait(reactor.epfd, events,
+                REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                log_error("epoll errno %d", errno);
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            struct reactor_entry *e;
+
+            if (events[i].data.fd == reactor.wake_fd) {
+                uint64_t cnt;
+
+                read(reactor.wake_fd, &cnt, sizeof(cnt));
+                continue;
+            }
+            pthread_mutex_lock(&reactor.lock);
+            e = find_entry(events[i].data.fd);
+            if (e)
+                e->busy = true;
+            pthread_mutex_unlock(&reactor.lock);
+            if (!e)
+                continue;
+
+            e->cb(e->priv, events[i].events);
+
+            pthread_mutex_lock(&reactor.lock);
+            e->busy = false;
+            if (e->removed)
+                free(e);
+            pthread_cond_broadcast(&reactor.idle);
+            pthread_mutex_unlock(&reactor.lock);
+
+            /* Stopped from the callback, the last fd is gone and a new
+             * thread may already be dispatching. The rest of the batch
+             * is for removed fds, an fd added since is reported to the
+             * new thread by its own EPOLL_CTL_ADD.
+             */
+            if (__atomic_load_n(&reactor.gen, __ATOMIC_ACQUIRE) != gen)
+                break;
+        }
+    }
+    log_info("quit");
+    return NULL;
+}
+
+static int reactor_open(void)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+    };
+
+    reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor.epfd < 0) {
+        log_error("epoll_create errno %d", errno);
+        return -1;
+    }
+    reactor.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor.wake_fd < 0) {
+        log_error("eventfd errno %d", errno);
+        goto err;
+    }
+    ev.data.fd = reactor.wake_fd;
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, reactor.wake_fd, &ev)) {
+        log_error("wake fd epoll_ctl errno %d", errno);
+        close(reactor.wake_fd);
+        reactor.wake_fd = -1;
+        goto err;
+    }
+    return 0;
+
+err:
+    close(reactor.epfd);
+    reactor.epfd = -1;
+    return -1;
+}
+
+static void reactor_wake(void)
+{
+    uint64_t one = 1;
+
+    if (write(reactor.wake_fd, &one, sizeof(one)) != sizeof(one))
+        log_error("wake errno %d", errno);
+}
+
+/* with life_lock held */
+static int reactor_start(void)
+{
+    uint32_t gen;
+
+    if (reactor.epfd < 0 && reactor_open())
+        return -1;
+    if (reactor.running)
+        return 0;
+
+    gen = __atomic_add_fetch(&reactor.gen, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&reactor.thread, NULL, reactor_thread,
+                (void *)(uintptr_t)gen)) {
+        log_error("create thread errno %d", errno);
+        return -1;
+    }
+    reactor.running = true;
+    return 0;
+}
+
+/* with life_lock held, after the last user is gone */
+static void reactor_stop(bool self)
+{
+    /* stop the thread, it sees the new gen once woken */
+    __atomic_add_fetch(&reactor.gen, 1, __ATOMIC_RELEASE);
+    if (self) {
+        pthread_detach(reactor.thread);
+    } else {
+        reactor_wake();
+        pthread_join(reactor.thread, NULL);
+    }
+    reactor.running = false;
+}
+
+int reactor_hold(void)
+{
+    int rc;
+
+    pthread_mutex_lock(&reactor.life_lock);
+    rc = reactor_start();
+    if (!rc)
+        reactor.users++;
+    pthread_mutex_unlock(&reactor.life_lock);
+    return rc;
+}
+
+void reactor_release(void)
+{
+    bool self;
+
+    pthread_mutex_lock(&reactor.life_lock);
+    self = reactor.running &&
+        pthread_equal(pthread_self(), reactor.thread);
+    if (reactor.users && !--reactor.users)
+        reactor_stop(self);
+    pthread_mutex_unlock(&reactor.life_lock);
+}
+
+int reactor_add(int fd, reactor_cb cb, void *priv)
+{
+    struct reactor_entry *e;
+    struct epoll_event ev = {
+        /* one wake up per notification, handler clears it */
+        .events = msync_session_notify_events() | EPOLLET,
+        .data.fd = fd,
+    };
+
+    e = (struct reactor_entry *)calloc(1, sizeof(*e));
+    if (!e) {
+        log_error("OOM");
+        return -1;
+    }
+    e->fd = fd;
+    e->cb = cb;
+    e->priv = priv;
+
+    pthread_mutex_lock(&reactor.life_lock);
+    if (reactor_start())
+        goto err;
+
+    pthread_mutex_lock(&reactor.lock);
+    e->next = reactor.entries;
+    reactor.entries = e;
+    pthread_mutex_unlock(&reactor.lock);
+    reactor.users++;
+
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        log_error("fd %d epoll_ctl errno %d", fd, errno);
+        pthread_mutex_unlock(&reactor.life_lock);
+        reactor_remove(fd);
+        return -1;
+    }
+    pthread_mutex_unlock(&reactor.life_lock);
+    return 0;
+
+err:
+    pthread_mutex_unlock(&reactor.life_lock);
+    free(e);
+    return -1;
+}
+
+void reactor_remove(int fd)
+{
+    struct reactor_entry **p, *e = NULL;
+    bool self = false, found;
+
+    pthread_mutex_lock(&reactor.life_lock);
+    if (reactor.running)
+        self = pthread_equal(pthread_self(), reactor.thread);
+    epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    pthread_mutex_lock(&reactor.lock);
+    for (p = &reactor.entries; *p; p = &(*p)->next) {
+        if ((*p)->fd == fd) {
+            e = *p;
+            *p = e->next;
+            break;
+        }
+    }
+    found = e != NULL;
+    if (e && e->busy && self) {
+        /* removed from its own callback */
+        e->removed = true;
+        e = NULL;
+    }
+    pthread_mutex_unlock(&reactor.lock);
+    pthread_mutex_unlock(&reactor.life_lock);
+
+    /* The callback may add or remove other fds, so wait for it without
+     * life_lock. The entry is unlinked and still counted in users, the
+     * thread keeps running until it is freed.
+     */
+    if (e) {
+        pthread_mutex_lock(&reactor.lock);
+        while (e->busy)
+            pthread_cond_wait(&reactor.idle, &reactor.lock);
+        pthread_mutex_unlock(&reactor.lock);
+        free(e);
+    }
+
+    if (!found)
+        return;
+    pthread_mutex_lock(&reactor.life_lock);
+    if (!--reactor.users)
+        reactor_stop(self);
+    pthread_mutex_unlock(&reactor.life_lock);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2021 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description: one thread watching mode change of all session fds
+ * of the process.
+ */
+#ifndef AML_AVSYNC_REACTOR_H
+#define AML_AVSYNC_REACTOR_H
+
+#include <stdint.h>
+
+typedef void (*reactor_cb)(void *priv, uint32_t events);
+
+/* @cb runs on the reactor thread, started with the first fd */
+int reactor_add(int fd, reactor_cb cb, void *priv);
+/* after return @cb of @fd is not running and will not run again */
+void reactor_remove(int fd);
+/* keep the thread running without any fd, e.g. across channel change */
+int reactor_hold(void);
+void reactor_release(void);
+
+#endif
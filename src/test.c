@@ -209,6 +209,20 @@ static void test_a(bool sync)
         }
     }
 
+    {
+        struct av_sync_stats stats;
+
+        /* default policy publishes every 200ms of audio, not per render */
+        if (!av_sync_get_stats(attach_handle, &stats)) {
+            log_info("apts published %llu of %llu renders",
+                    (unsigned long long)stats.apts_publish_cnt,
+                    (unsigned long long)stats.apts_render_cnt);
+            if (stats.apts_render_cnt &&
+                    stats.apts_publish_cnt * 10 > stats.apts_render_cnt)
+                log_error("apts not decimated");
+        }
+    }
+
 exit3:
     av_sync_destroy(attach_handle);
 exit2: